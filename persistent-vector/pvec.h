@@ -27,13 +27,17 @@
 #include <stdint.h>
 
 #ifndef PVEC_BITS
-// PVEC_BITS is b, the total amount of bits used per node in the trie.
+// PVEC_BITS is b, the total amount of bits used per node in the trie. For
+// illustration purposes, we use b = 2. With 8 byte pointers, b = 3 makes every
+// node exactly 64 bytes, which is a common cache line size.
 #define PVEC_BITS 2
+#endif
 
+#ifndef PVEC_MAX_HEIGHT
 // PVEC_MAX_HEIGHT is the maximal height of a trie. With 32 bits and b = 5, we
-// can at most have 2**32 - 1 elements, which is equal to 7 levels. However, for
-// illustration purposes, we use b = 2, meaning we can have at most 16 levels.
-#define PVEC_MAX_HEIGHT 16
+// can at most have 2**32 - 1 elements, which is equal to 7 levels. With b = 2,
+// we can at most have 16 levels.
+#define PVEC_MAX_HEIGHT ((32 + PVEC_BITS - 1) / PVEC_BITS)
 #endif
 
 // PVEC_BRANCHING is the branching factor. With n bits, we have 2**n elements in
@@ -73,6 +77,88 @@ const Pvec* pvec_update(const Pvec *restrict pvec, uint32_t index, const void *r
 // new size should be less than or equal the current size.
 const Pvec* pvec_right_slice(const Pvec *pvec, uint32_t new_size);
 
+#if defined(VANILLA_PVEC) || defined(HASHED_PVEC)
+
+// pvec_equals returns 1 if the two persistent vectors contain the same elements
+// (compared by pointer value), otherwise 0. Subtrees shared by both vectors are
+// not visited, so comparing a vector with a version of itself only costs
+// O(differences * log n).
+int pvec_equals(const Pvec *a, const Pvec *b);
+#endif
+
+#ifdef VANILLA_PVEC
+
+// pvec_push_many returns a new persistent vector with the k elements in elts
+// appended onto this persistent vector. It is equivalent to k calls to
+// pvec_push, but only allocates the nodes present in the result.
+const Pvec* pvec_push_many(const Pvec *restrict pvec, void *const *restrict elts,
+                           uint32_t k);
+
+// An iterator over the elements of a persistent vector, in order. It keeps the
+// leaf it is in, so it only walks down the trie once per leaf instead of once
+// per element. The fields are private.
+typedef struct {
+  const Pvec *pvec;
+  uint32_t index;
+  void *const *leaf;
+} PvecIter;
+
+// pvec_iter returns an iterator starting at the given index. pvec_iter_next
+// stores the next element in *elt and returns 1, or returns 0 when there are no
+// elements left.
+PvecIter pvec_iter(const Pvec *pvec, uint32_t index);
+int pvec_iter_next(PvecIter *iter, void **elt);
+
+// A persistent vector passed and returned by value. The pvec_val_* functions
+// mirror the functions above, but only allocate trie nodes: The head lives
+// wherever the PvecVal is stored, so short-lived versions on the stack cost no
+// allocation. root is opaque and must not be modified.
+typedef struct {
+  uint32_t size;
+  uint32_t shift;
+  const void *root;
+} PvecVal;
+
+// pvec_val returns the value of a persistent vector, pvec_from_val copies a
+// value into a newly allocated head.
+PvecVal pvec_val(const Pvec *pvec);
+const Pvec* pvec_from_val(PvecVal val);
+
+PvecVal pvec_val_create(void);
+void* pvec_val_nth(PvecVal val, uint32_t index);
+PvecVal pvec_val_update(PvecVal val, uint32_t index, const void *elt);
+PvecVal pvec_val_push(PvecVal val, const void *elt);
+PvecVal pvec_val_pop(PvecVal val);
+PvecVal pvec_val_right_slice(PvecVal val, uint32_t new_size);
+
+// An opaque, lazy view over a persistent vector. Views only record the
+// operations applied to them: Nothing is computed until the view is
+// materialised, and no intermediate vectors are built.
+typedef struct _PvecView PvecView;
+
+// pvec_view returns a view of all the elements in this persistent vector.
+const PvecView* pvec_view(const Pvec *pvec);
+
+// pvec_view_map returns a view where every element is replaced with fn(elt,
+// ctx). pvec_view_filter returns a view with only the elements where pred(elt,
+// ctx) is nonzero. fn and pred should be pure: They are only called on the
+// elements that reach them when the view is materialised.
+const PvecView* pvec_view_map(const PvecView *view,
+                              void *(*fn)(void *elt, void *ctx), void *ctx);
+const PvecView* pvec_view_filter(const PvecView *view,
+                                 int (*pred)(void *elt, void *ctx), void *ctx);
+
+// pvec_view_take returns a view of the first n elements in the view.
+// pvec_view_slice returns a view of the elements in [from, to). Both are
+// clamped to the elements available.
+const PvecView* pvec_view_take(const PvecView *view, uint32_t n);
+const PvecView* pvec_view_slice(const PvecView *view, uint32_t from, uint32_t to);
+
+// pvec_view_materialise returns a persistent vector with the elements in the
+// view. The result is built bottom-up, one leaf at a time.
+const Pvec* pvec_view_materialise(const PvecView *view);
+#endif
+
 // const Pvec* pvec_concat(const Pvec *left, const Pvec *right);
 // const Pvec* pvec_slice(const Pvec *pvec, uint32_t from, uint32_t to);
 
@@ -94,4 +180,238 @@ void* transient_pvec_peek(const TransientPvec *tpvec);
 TransientPvec* transient_pvec_push(TransientPvec *restrict tpvec, const void *restrict elt);
 TransientPvec* transient_pvec_update(TransientPvec *restrict tpvec, uint32_t index, const void *restrict elt);
 #endif
+
+#ifdef PVEC_STATS
+
+// The operations with latency histograms.
+typedef enum {
+  PVEC_OP_NTH,
+  PVEC_OP_PUSH,
+  PVEC_OP_UPDATE,
+  PVEC_OP_POP,
+  PVEC_OP_RIGHT_SLICE,
+  PVEC_OP_COUNT,
+} PvecOp;
+
+// A summary of the latencies of an operation, in time stamp counter ticks on
+// x86, and nanoseconds elsewhere. The values are the upper bounds of the
+// histogram buckets they fall in.
+typedef struct {
+  uint64_t count;
+  uint64_t min, p50, p99, p999, max;
+} PvecStats;
+
+// pvec_stats summarises the latencies recorded for op by all threads.
+void pvec_stats(PvecOp op, PvecStats *stats);
+
+// pvec_stats_reset clears the histograms. Operations running at the same time
+// may or may not be recorded.
+void pvec_stats_reset(void);
+#endif
+
+#ifdef PVEC_PARALLEL
+
+// pvec_from_array_parallel returns a persistent vector with the n elements in
+// elts. Subtrees of the vector are independent, so they are built by up to the
+// given number of threads, including the calling one. Passing 0 threads is the
+// same as passing 1.
+const Pvec* pvec_from_array_parallel(void *const *elts, uint32_t n,
+                                     uint32_t threads);
+
+// pvec_filter_parallel returns a persistent vector with the elements where
+// pred(elt, ctx) is nonzero, evaluated by up to the given number of threads, so
+// pred has to be thread safe. The result is built densely, without copying any
+// paths.
+const Pvec* pvec_filter_parallel(const Pvec *pvec,
+                                 int (*pred)(void *elt, void *ctx), void *ctx,
+                                 uint32_t threads);
+#endif
+
+#ifdef REFCOUNT_PVEC
+
+// pvec_retain increments the reference count of this persistent vector and
+// returns it.
+const Pvec* pvec_retain(const Pvec *pvec);
+
+// pvec_release decrements the reference count of this persistent vector, and
+// frees it along with the nodes no other vector refers to when it reaches zero.
+void pvec_release(const Pvec *pvec);
+
+// The _owned functions are equivalent to their persistent counterparts, but
+// consume the reference to the input vector. Nodes only referenced through the
+// input are modified in place instead of being copied.
+const Pvec* pvec_pop_owned(const Pvec *pvec);
+const Pvec* pvec_push_owned(const Pvec *restrict pvec, const void *restrict elt);
+const Pvec* pvec_update_owned(const Pvec *restrict pvec, uint32_t index, const void *restrict elt);
+
+#ifdef PVEC_EPOCH
+
+// Threads other than the writer may read vectors without taking references to
+// them between pvec_epoch_enter and pvec_epoch_exit. Memory released by the
+// writer is not freed while a reader could still see it. Critical sections
+// cannot be nested.
+void pvec_epoch_enter(void);
+void pvec_epoch_exit(void);
+
+// pvec_epoch_synchronize waits until all memory released so far is freed. It is
+// called by the writer, outside a critical section.
+void pvec_epoch_synchronize(void);
+#endif
+#endif
+
+#ifdef HASHED_PVEC
+
+// pvec_hash returns a hash of the elements (by pointer value) in this
+// persistent vector. Every node caches the hash of its subtree, so this is
+// O(1). Equal vectors have equal hashes.
+uint64_t pvec_hash(const Pvec *pvec);
+
+// pvec_sync_serve sends this persistent vector to a replica calling
+// pvec_sync_fetch on the other end of the given file descriptors. It returns
+// the number of nodes sent, or -1 on I/O errors. Elements are sent by value, so
+// they should not be pointers into this process.
+int64_t pvec_sync_serve(const Pvec *pvec, int in_fd, int out_fd);
+
+// pvec_sync_fetch receives the persistent vector sent by pvec_sync_serve. Only
+// nodes with hashes different from the node at the same position in local are
+// transferred, the rest are shared with local. It returns NULL on I/O errors,
+// or if the nodes received do not match their hashes.
+const Pvec* pvec_sync_fetch(const Pvec *local, int in_fd, int out_fd);
+#endif
+
+#ifdef SHM_PVEC
+
+// pvec_shm_open maps the shared memory segment with the given name, creating it
+// with the given size if it does not exist. All vectors are stored in this
+// segment, so it must be called before any other function. Returns 0 on
+// success, -1 on errors.
+int pvec_shm_open(const char *name, uint64_t size);
+
+// pvec_shm_close unmaps the segment. pvec_shm_unlink removes it once every
+// process has closed it.
+void pvec_shm_close(void);
+int pvec_shm_unlink(const char *name);
+
+// pvec_shm_current returns the last vector published in the segment, or an
+// empty vector if none has been published.
+const Pvec* pvec_shm_current(void);
+
+// pvec_shm_publish makes pvec the current vector of the segment if the current
+// vector is still expected. Returns 1 if it was published, 0 otherwise.
+int pvec_shm_publish(const Pvec *expected, const Pvec *pvec);
+#endif
+
+#ifdef COMPRESSED_PVEC
+
+// pvec_compact copies the n given vectors into new arenas, and replaces them
+// with their copies. Subtrees shared by the vectors stay shared. The old arenas
+// are then dropped, so every other vector becomes invalid. With n = 0, all
+// vectors are dropped.
+void pvec_compact(const Pvec **pvecs, uint32_t n);
+#endif
+
+#ifdef LOG_PVEC
+
+// pvec_log_open opens the log file at the given path, creating it if it does
+// not exist, and returns the last version appended to it (or an empty vector).
+// Returns NULL on errors. Only one log can be open at a time, and vectors from
+// before the log was opened should not be appended to it.
+const Pvec* pvec_log_open(const char *path);
+
+// pvec_log_append appends this persistent vector to the log. Only the nodes not
+// already in the log are written. Returns 0 on success, -1 on errors.
+int pvec_log_append(const Pvec *pvec);
+
+// pvec_log_sync forces the versions appended so far to disk. pvec_log_close
+// does the same before closing the log. Both return 0 on success, -1 on errors.
+int pvec_log_sync(void);
+int pvec_log_close(void);
+#endif
+
+#ifdef SPARSE_PVEC
+
+// An opaque sparse persistent vector struct. Its indices are 64-bit, and every
+// index holds NULL until it is set.
+typedef struct _SparsePvec SparsePvec;
+
+const SparsePvec* sparse_pvec_create(void);
+
+// sparse_pvec_count returns the number of elements which are not NULL.
+uint64_t sparse_pvec_count(const SparsePvec *spvec);
+void* sparse_pvec_nth(const SparsePvec *spvec, uint64_t index);
+
+// sparse_pvec_update returns a new sparse vector where the element at the given
+// index is elt. Setting it to NULL removes it.
+const SparsePvec* sparse_pvec_update(const SparsePvec *restrict spvec,
+                                     uint64_t index, const void *restrict elt);
+
+// sparse_pvec_next finds the first element which is not NULL at *index or
+// later. If there is one, it is stored in *elt, its index in *index, and 1 is
+// returned. Otherwise it returns 0.
+int sparse_pvec_next(const SparsePvec *spvec, uint64_t *index, void **elt);
+#endif
+
+#ifdef MONOID_PVEC
+
+#ifndef PVEC_AGG_TYPE
+// PVEC_AGG_TYPE is the type of the aggregates cached in monoid vectors.
+#define PVEC_AGG_TYPE int64_t
+#endif
+
+typedef PVEC_AGG_TYPE PvecAgg;
+
+// A PvecMonoid describes how aggregates are computed: measure maps a single
+// element to an aggregate, and combine must be associative with identity as
+// its identity element. It does not have to be commutative.
+typedef struct {
+  PvecAgg identity;
+  PvecAgg (*measure)(const void *elt);
+  PvecAgg (*combine)(PvecAgg a, PvecAgg b);
+} PvecMonoid;
+
+// pvec_create_monoid returns an empty vector aggregating its elements with the
+// given monoid, which must outlive it. Vectors from pvec_create sum their
+// elements as integers.
+const Pvec* pvec_create_monoid(const PvecMonoid *monoid);
+
+// pvec_aggregate returns the aggregate of the elements in [from, to) in
+// O(log n). The prefix aggregate up to index is pvec_aggregate(pvec, 0, index).
+PvecAgg pvec_aggregate(const Pvec *pvec, uint32_t from, uint32_t to);
+
+// pvec_search_prefix returns the first index where pred(agg, ctx) is nonzero
+// for the prefix aggregate agg of the elements up to and including index, or
+// the size of the vector if there is none. pred must be monotone: Once nonzero
+// for a prefix, it must be nonzero for all longer prefixes. This is O(log n).
+uint32_t pvec_search_prefix(const Pvec *pvec,
+                            int (*pred)(PvecAgg agg, void *ctx), void *ctx);
+#endif
+
+#ifdef BYTE_PVEC
+
+#ifndef PVEC_LEAF_BITS
+// PVEC_LEAF_BITS is the number of bits used per leaf in byte vectors: Every
+// leaf contains 2**PVEC_LEAF_BITS bytes.
+#define PVEC_LEAF_BITS 7
+#endif
+
+// An opaque persistent byte vector struct.
+typedef struct _BytePvec BytePvec;
+
+const BytePvec* byte_pvec_create(void);
+uint32_t byte_pvec_count(const BytePvec *bpvec);
+uint8_t byte_pvec_nth(const BytePvec *bpvec, uint32_t index);
+const BytePvec* byte_pvec_update(const BytePvec *bpvec, uint32_t index, uint8_t byte);
+
+// byte_pvec_append returns a new byte vector with the n given bytes appended,
+// or NULL if the result would be too large to index with 32 bits.
+const BytePvec* byte_pvec_append(const BytePvec *restrict bpvec,
+                                 const uint8_t *restrict bytes, uint32_t n);
+
+// byte_pvec_slice returns a new byte vector with the bytes in [from, to).
+const BytePvec* byte_pvec_slice(const BytePvec *bpvec, uint32_t from, uint32_t to);
+
+// byte_pvec_copy copies the n bytes starting at from into out.
+void byte_pvec_copy(const BytePvec *restrict bpvec, uint32_t from, uint32_t n,
+                    uint8_t *restrict out);
+#endif
 #endif
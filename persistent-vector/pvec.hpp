@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2014 Jean Niklas L'orange. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef PVEC_HPP
+#define PVEC_HPP
+
+/*
+ * A header-only C++ version of the vanilla persistent vector. The trie
+ * algorithms are the same as in pvec_vanilla.c, but elements are stored
+ * directly inside the leaves instead of behind a void pointer, and memory is
+ * reference counted instead of garbage collected.
+ *
+ * Operations on an lvalue return a new version and leave the original as is.
+ * Operations on an rvalue consume it: nodes nobody else refers to are modified
+ * in place, so chains like pvec<int>().push_back(1).push_back(2) do not copy
+ * anything.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <new>
+#include <utility>
+
+namespace persistencia {
+
+// Bits is b, the total amount of bits used per node in the trie.
+template <typename T, unsigned Bits = 5>
+class pvec {
+  static_assert(Bits > 0 && Bits < 16, "Bits must be between 1 and 15");
+
+  static constexpr uint32_t branching = uint32_t(1) << Bits;
+  static constexpr uint32_t mask = branching - 1;
+
+  struct node {
+    std::atomic<uint32_t> refs{1};
+    const bool is_leaf;
+    explicit node(bool is_leaf) : is_leaf(is_leaf) {}
+  };
+
+  struct inner;
+  struct leaf;
+
+  // node_ptr owns a single reference to a node. It can be moved, but not
+  // copied: Taking another reference has to be done explicitly through share.
+  class node_ptr {
+    node *ptr = nullptr;
+  public:
+    node_ptr() = default;
+    explicit node_ptr(node *ptr) : ptr(ptr) {}
+    node_ptr(const node_ptr&) = delete;
+    node_ptr& operator=(const node_ptr&) = delete;
+    node_ptr(node_ptr&& other) noexcept : ptr(other.ptr) { other.ptr = nullptr; }
+    node_ptr& operator=(node_ptr&& other) noexcept {
+      std::swap(ptr, other.ptr);
+      other.reset();
+      return *this;
+    }
+    ~node_ptr() { reset(); }
+
+    node_ptr share() const {
+      if (ptr != nullptr) {
+        ptr->refs.fetch_add(1, std::memory_order_relaxed);
+      }
+      return node_ptr(ptr);
+    }
+
+    void reset() {
+      if (ptr != nullptr && ptr->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        if (ptr->is_leaf) {
+          delete static_cast<leaf *>(ptr);
+        }
+        else {
+          delete static_cast<inner *>(ptr);
+        }
+      }
+      ptr = nullptr;
+    }
+
+    // unique returns true if this is the only reference to the node, in which
+    // case it is safe to modify it.
+    bool unique() const {
+      return ptr->refs.load(std::memory_order_acquire) == 1;
+    }
+
+    explicit operator bool() const { return ptr != nullptr; }
+    inner *as_inner() const { return static_cast<inner *>(ptr); }
+    leaf *as_leaf() const { return static_cast<leaf *>(ptr); }
+  };
+
+  struct inner : node {
+    node_ptr child[branching];
+    inner() : node(false) {}
+    inner(const inner& other) : node(false) {
+      for (uint32_t i = 0; i < branching; i++) {
+        child[i] = other.child[i].share();
+      }
+    }
+  };
+
+  // Leaves keep track of how many elements they contain, so that only those
+  // are constructed and destroyed.
+  struct leaf : node {
+    uint32_t count = 0;
+    alignas(T) unsigned char storage[sizeof(T) * branching];
+    leaf() : node(true) {}
+    leaf(const leaf& other) : node(true) {
+      for (; count < other.count; count++) {
+        new (elts() + count) T(other.elts()[count]);
+      }
+    }
+    ~leaf() {
+      for (uint32_t i = 0; i < count; i++) {
+        elts()[i].~T();
+      }
+    }
+    T *elts() { return std::launder(reinterpret_cast<T *>(storage)); }
+    const T *elts() const { return std::launder(reinterpret_cast<const T *>(storage)); }
+  };
+
+  // The size of the vector.
+  uint32_t size_ = 0;
+  // The height of the vector, represented as a shift.
+  uint32_t shift_ = 0;
+  // The root of the vector. nullptr when the vector is empty.
+  node_ptr root_;
+
+  // The make_ functions are the clone-or-create part of the algorithms: They
+  // return a node in slot which is safe to modify, copying it first if it is
+  // shared.
+  static inner *make_inner(node_ptr& slot) {
+    if (!slot) {
+      slot = node_ptr(new inner());
+    }
+    else if (!slot.unique()) {
+      slot = node_ptr(new inner(*slot.as_inner()));
+    }
+    return slot.as_inner();
+  }
+
+  static leaf *make_leaf(node_ptr& slot) {
+    if (!slot) {
+      slot = node_ptr(new leaf());
+    }
+    else if (!slot.unique()) {
+      slot = node_ptr(new leaf(*slot.as_leaf()));
+    }
+    return slot.as_leaf();
+  }
+
+  // leaf_for returns the elements of the leaf containing index.
+  const T *leaf_for(uint32_t index) const {
+    const node_ptr *slot = &root_;
+    for (uint32_t s = shift_; s > 0; s -= Bits) {
+      slot = &slot->as_inner()->child[(index >> s) & mask];
+    }
+    return slot->as_leaf()->elts();
+  }
+
+  void push_back_mut(T&& elt) {
+    uint32_t index = size_;
+    // this is the d_full(P) check for bit vectors
+    if (root_ && index == (uint64_t(branching) << shift_)) {
+      inner *new_root = new inner();
+      new_root->child[0] = std::move(root_);
+      root_ = node_ptr(new_root);
+      shift_ += Bits;
+    }
+    node_ptr *slot = &root_;
+    for (uint32_t s = shift_; s > 0; s -= Bits) {
+      slot = &make_inner(*slot)->child[(index >> s) & mask];
+    }
+    leaf *l = make_leaf(*slot);
+    new (l->elts() + l->count) T(std::move(elt));
+    l->count++;
+    size_++;
+  }
+
+  void set_mut(uint32_t index, T&& elt) {
+    node_ptr *slot = &root_;
+    for (uint32_t s = shift_; s > 0; s -= Bits) {
+      slot = &make_inner(*slot)->child[(index >> s) & mask];
+    }
+    make_leaf(*slot)->elts()[index & mask] = std::move(elt);
+  }
+
+  void pop_back_mut() {
+    uint32_t index = size_ - 1;
+    size_--;
+    if (size_ == 0) {
+      root_.reset();
+      shift_ = 0;
+      return;
+    }
+    if (size_ == (uint32_t(1) << shift_) && shift_ > 0) {
+      root_ = root_.as_inner()->child[0].share();
+      shift_ -= Bits;
+      return;
+    }
+    node_ptr *slot = &root_;
+    for (uint32_t s = shift_; s > 0; s -= Bits) {
+      inner *n = make_inner(*slot);
+      slot = &n->child[(index >> s) & mask];
+      if ((index & ((uint32_t(1) << s) - 1)) == 0) {
+        // The last element is the only element in this subtree.
+        slot->reset();
+        return;
+      }
+    }
+    leaf *l = make_leaf(*slot);
+    l->count--;
+    l->elts()[l->count].~T();
+  }
+
+public:
+  using value_type = T;
+  using size_type = uint32_t;
+
+  // A random access iterator over the elements of a vector. It remembers the
+  // leaf it is in, so the trie is only walked when the iterator moves into
+  // another leaf. The iterator is valid as long as the vector it came from.
+  class const_iterator {
+    const pvec *vec_ = nullptr;
+    uint32_t index_ = 0;
+    // The elements of the leaf containing index_, or nullptr if we have not
+    // looked it up yet.
+    mutable const T *leaf_ = nullptr;
+
+    const_iterator(const pvec *vec, uint32_t index) : vec_(vec), index_(index) {}
+    friend class pvec;
+
+  public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T *;
+    using reference = const T&;
+
+    const_iterator() = default;
+
+    reference operator*() const {
+      if (leaf_ == nullptr) {
+        leaf_ = vec_->leaf_for(index_);
+      }
+      return leaf_[index_ & mask];
+    }
+    pointer operator->() const { return &**this; }
+    reference operator[](difference_type n) const { return *(*this + n); }
+
+    const_iterator& operator++() {
+      index_++;
+      if ((index_ & mask) == 0) {
+        leaf_ = nullptr;
+      }
+      return *this;
+    }
+    const_iterator& operator--() {
+      if ((index_ & mask) == 0) {
+        leaf_ = nullptr;
+      }
+      index_--;
+      return *this;
+    }
+    const_iterator operator++(int) { const_iterator old = *this; ++*this; return old; }
+    const_iterator operator--(int) { const_iterator old = *this; --*this; return old; }
+
+    const_iterator& operator+=(difference_type n) {
+      uint32_t index = uint32_t(index_ + n);
+      if ((index >> Bits) != (index_ >> Bits)) {
+        leaf_ = nullptr;
+      }
+      index_ = index;
+      return *this;
+    }
+    const_iterator& operator-=(difference_type n) { return *this += -n; }
+    friend const_iterator operator+(const_iterator it, difference_type n) { return it += n; }
+    friend const_iterator operator+(difference_type n, const_iterator it) { return it += n; }
+    friend const_iterator operator-(const_iterator it, difference_type n) { return it -= n; }
+    friend difference_type operator-(const const_iterator& a, const const_iterator& b) {
+      return difference_type(a.index_) - difference_type(b.index_);
+    }
+
+    friend bool operator==(const const_iterator& a, const const_iterator& b) { return a.index_ == b.index_; }
+    friend bool operator!=(const const_iterator& a, const const_iterator& b) { return a.index_ != b.index_; }
+    friend bool operator<(const const_iterator& a, const const_iterator& b) { return a.index_ < b.index_; }
+    friend bool operator>(const const_iterator& a, const const_iterator& b) { return a.index_ > b.index_; }
+    friend bool operator<=(const const_iterator& a, const const_iterator& b) { return a.index_ <= b.index_; }
+    friend bool operator>=(const const_iterator& a, const const_iterator& b) { return a.index_ >= b.index_; }
+  };
+  using iterator = const_iterator;
+
+  pvec() = default;
+  pvec(const pvec& other)
+    : size_(other.size_), shift_(other.shift_), root_(other.root_.share()) {}
+  pvec(pvec&& other) noexcept
+    : size_(other.size_), shift_(other.shift_), root_(std::move(other.root_)) {
+    other.size_ = 0;
+    other.shift_ = 0;
+  }
+  pvec& operator=(const pvec& other) {
+    return *this = pvec(other);
+  }
+  pvec& operator=(pvec&& other) noexcept {
+    if (this == &other) {
+      return *this;
+    }
+    size_ = other.size_;
+    shift_ = other.shift_;
+    root_ = std::move(other.root_);
+    other.size_ = 0;
+    other.shift_ = 0;
+    return *this;
+  }
+
+  uint32_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  const T& operator[](uint32_t index) const {
+    return leaf_for(index)[index & mask];
+  }
+
+  const T& back() const { return (*this)[size_ - 1]; }
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, size_); }
+
+  // push_back returns a new persistent vector with elt appended onto this one.
+  pvec push_back(T elt) const & {
+    pvec copy(*this);
+    copy.push_back_mut(std::move(elt));
+    return copy;
+  }
+  pvec push_back(T elt) && {
+    push_back_mut(std::move(elt));
+    return std::move(*this);
+  }
+
+  // set returns a new persistent vector where the element at the given index
+  // is replaced with elt.
+  pvec set(uint32_t index, T elt) const & {
+    pvec copy(*this);
+    copy.set_mut(index, std::move(elt));
+    return copy;
+  }
+  pvec set(uint32_t index, T elt) && {
+    set_mut(index, std::move(elt));
+    return std::move(*this);
+  }
+
+  // pop_back returns a new persistent vector with the last element removed.
+  pvec pop_back() const & {
+    pvec copy(*this);
+    copy.pop_back_mut();
+    return copy;
+  }
+  pvec pop_back() && {
+    pop_back_mut();
+    return std::move(*this);
+  }
+};
+
+} // namespace persistencia
+
+#endif
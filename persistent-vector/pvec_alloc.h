@@ -28,8 +28,39 @@
  * This is just an allocation header which depends on Boehm GC. It's done to
  * make the code easy to understand: Including refcounting makes the code very
  * hard to read.
+ *
+ * The exception is the reference counted implementation (REFCOUNT_PVEC), which
+ * manages its own memory and frees it explicitly through PVEC_FREE.
  */
 
+#ifdef REFCOUNT_PVEC
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PVEC_MALLOC(size) calloc(1, (size))
+#define PVEC_REALLOC realloc
+#define PVEC_MALLOC_ATOMIC(size) calloc(1, (size))
+
+// Frees memory allocated through the macros above.
+#define PVEC_FREE free
+
+#ifdef PVEC_CACHE_LINE
+static inline void *pvec_malloc_aligned(size_t size) {
+  void *ptr = aligned_alloc(PVEC_CACHE_LINE, size);
+  return memset(ptr, 0, size);
+}
+#define PVEC_MALLOC_NODE pvec_malloc_aligned
+#endif
+
+#else
+
+#ifdef PVEC_PARALLEL
+// Threads allocating through the collector have to be registered with it. With
+// GC_THREADS defined, gc.h redirects pthread_create to do that.
+#define GC_THREADS
+#endif
+
 #include <gc/gc.h>
 
 // Allocation of memory which may contain pointers. The returned contents must
@@ -40,8 +71,24 @@
 // widened, the extra memory must be nulled (like calloc).
 #define PVEC_REALLOC GC_REALLOC
 
-// Allocation of memory which will never contain pointers. The returned contents
-// must be nulled (like calloc).
+// Allocation of memory which will never contain pointers. Unlike the others,
+// the returned contents are not nulled (like malloc).
 #define PVEC_MALLOC_ATOMIC GC_MALLOC_ATOMIC
 
+#ifdef PVEC_CACHE_LINE
+#define PVEC_MALLOC_NODE(size) GC_memalign(PVEC_CACHE_LINE, (size))
+#endif
+
+#endif
+
+// If PVEC_CACHE_LINE is defined, trie nodes are aligned to it. Node sizes are
+// rounded up to a multiple of the cache line size, so a node never straddles
+// two lines. PVEC_MALLOC_NODE allocates (nulled) memory for nodes.
+#ifdef PVEC_CACHE_LINE
+#define PVEC_NODE_ALIGN _Alignas(PVEC_CACHE_LINE)
+#else
+#define PVEC_NODE_ALIGN
+#define PVEC_MALLOC_NODE PVEC_MALLOC
+#endif
+
 #endif
@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2014 Jean Niklas L'orange. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * This is a persistent vector of bytes, meant for large text buffers. It uses
+ * the same trie as the vanilla implementation, except that the leaves are not
+ * tables of pointers: They are packed arrays of 2**PVEC_LEAF_BITS raw bytes.
+ * Changing a byte therefore copies one leaf and the interior nodes above it,
+ * instead of every byte being an element of its own.
+ *
+ * To support slicing from the left, the vector head has an offset: The byte at
+ * index i is stored at position offset + i in the trie. Slices only copy the
+ * paths to their two ends, and cut away the parts of the trie outside them.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#define BYTE_PVEC
+#include "pvec.h"
+#include "pvec_alloc.h"
+
+#define PVEC_LEAF_SIZE (1 << PVEC_LEAF_BITS)
+
+// This is an interior trie node. It is always the branching factor size
+// (unused table entries will be NULL).
+typedef struct Node {
+  struct Node *child[PVEC_BRANCHING];
+} Node;
+
+// This is a leaf. The bytes contain no pointers, so leaves are allocated with
+// PVEC_MALLOC_ATOMIC.
+typedef struct Leaf {
+  uint8_t bytes[PVEC_LEAF_SIZE];
+} Leaf;
+
+struct _BytePvec {
+  // The size of the vector.
+  uint32_t size;
+  // The position of the first byte in the trie.
+  uint32_t offset;
+  // The height of the vector, represented as a shift. Interior nodes have the
+  // shifts PVEC_LEAF_BITS, PVEC_LEAF_BITS + PVEC_BITS, and so on. A shift of 0
+  // means that the root is a leaf.
+  uint32_t shift;
+  // The root of the vector. NULL if the vector is empty.
+  Node *root;
+};
+
+// An empty vector. (Not necessarily the only empty vector!)
+static BytePvec EMPTY_VECTOR = {.size = 0, .offset = 0, .shift = 0, .root = NULL};
+
+// These are just prototypes -- no need to worry about these.
+static inline Node *node_clone(const Node *node);
+static inline Leaf *leaf_clone(const Leaf *leaf);
+static inline BytePvec* byte_pvec_clone(const BytePvec *bpvec);
+
+// shift_down returns the shift of the children of a node with the given shift.
+static inline uint32_t shift_down(uint32_t shift) {
+  return shift == PVEC_LEAF_BITS ? 0 : shift - PVEC_BITS;
+}
+
+// capacity returns the number of bytes a node with the given shift can hold.
+static inline uint64_t capacity(uint32_t shift) {
+  return shift == 0 ? PVEC_LEAF_SIZE : (uint64_t) PVEC_BRANCHING << shift;
+}
+
+// leaf_for returns the leaf containing the given position in the trie.
+static inline const Leaf *leaf_for(const BytePvec *bpvec, uint32_t pos) {
+  const Node *node = bpvec->root;
+  for (uint32_t s = bpvec->shift; s > 0; s = shift_down(s)) {
+    node = node->child[(pos >> s) & PVEC_MASK];
+  }
+  return (const Leaf *) node;
+}
+
+const BytePvec* byte_pvec_create() {
+  return &EMPTY_VECTOR;
+}
+
+uint32_t byte_pvec_count(const BytePvec *bpvec) {
+  return bpvec->size;
+}
+
+uint8_t byte_pvec_nth(const BytePvec *bpvec, uint32_t index) {
+  uint32_t pos = bpvec->offset + index;
+  return leaf_for(bpvec, pos)->bytes[pos & (PVEC_LEAF_SIZE - 1)];
+}
+
+void byte_pvec_copy(const BytePvec *restrict bpvec, uint32_t from, uint32_t n,
+                    uint8_t *restrict out) {
+  uint32_t pos = bpvec->offset + from;
+  while (n > 0) {
+    uint32_t start = pos & (PVEC_LEAF_SIZE - 1);
+    uint32_t len = PVEC_LEAF_SIZE - start;
+    if (n < len) {
+      len = n;
+    }
+    memcpy(out, &leaf_for(bpvec, pos)->bytes[start], len);
+    out += len;
+    pos += len;
+    n -= len;
+  }
+}
+
+const BytePvec* byte_pvec_update(const BytePvec *bpvec, uint32_t index,
+                                 uint8_t byte) {
+  uint32_t pos = bpvec->offset + index;
+  BytePvec *clone = byte_pvec_clone(bpvec);
+  Node **slot = &clone->root;
+  for (uint32_t s = bpvec->shift; s > 0; s = shift_down(s)) {
+    *slot = node_clone(*slot);
+    slot = &(*slot)->child[(pos >> s) & PVEC_MASK];
+  }
+  Leaf *leaf = leaf_clone((const Leaf *) *slot);
+  leaf->bytes[pos & (PVEC_LEAF_SIZE - 1)] = byte;
+  *slot = (Node *) leaf;
+  return (const BytePvec*) clone;
+}
+
+// append_rec returns a copy of node (or a new node if node is NULL) where the n
+// bytes are placed from pos and onwards. pos is relative to the subtree node
+// represents. As with pvec_push_many, every node is copied or created once.
+static Node *append_rec(const Node *node, uint32_t shift, uint32_t pos,
+                        const uint8_t *bytes, uint32_t n) {
+  if (shift == 0) {
+    Leaf *leaf = (node == NULL) ? PVEC_MALLOC_ATOMIC(sizeof(Leaf))
+                                : leaf_clone((const Leaf *) node);
+    memcpy(&leaf->bytes[pos], bytes, n);
+    return (Node *) leaf;
+  }
+  Node *copy = (node == NULL) ? PVEC_MALLOC(sizeof(Node)) : node_clone(node);
+  while (n > 0) {
+    uint32_t subindex = (pos >> shift) & PVEC_MASK;
+    uint32_t child_pos = pos & ((1u << shift) - 1);
+    uint32_t len = (1u << shift) - child_pos;
+    if (n < len) {
+      len = n;
+    }
+    copy->child[subindex] = append_rec(copy->child[subindex], shift_down(shift),
+                                       child_pos, bytes, len);
+    pos += len;
+    bytes += len;
+    n -= len;
+  }
+  return copy;
+}
+
+const BytePvec* byte_pvec_append(const BytePvec *restrict bpvec,
+                                 const uint8_t *restrict bytes, uint32_t n) {
+  if (n == 0) {
+    return bpvec;
+  }
+  // Positions in the trie are 32 bits, so the last byte has to be at or below
+  // position UINT32_MAX - 1. This also keeps the size from overflowing.
+  uint64_t end = (uint64_t) bpvec->offset + bpvec->size + n;
+  if (end > UINT32_MAX) {
+    return NULL;
+  }
+  BytePvec *clone = byte_pvec_clone(bpvec);
+  clone->size = bpvec->size + n;
+  // As in pvec_push_many, new roots are made on the stack, and are copied onto
+  // the heap by append_rec.
+  Node grown[32];
+  Node *root = clone->root;
+  uint32_t levels = 0;
+  while (end > capacity(clone->shift)) {
+    Node *new_root = &grown[levels++];
+    memset(new_root, 0, sizeof(Node));
+    new_root->child[0] = root;
+    root = new_root;
+    clone->shift = (clone->shift == 0) ? PVEC_LEAF_BITS : clone->shift + PVEC_BITS;
+  }
+  clone->root = append_rec(root, clone->shift, bpvec->offset + bpvec->size,
+                           bytes, n);
+  return (const BytePvec*) clone;
+}
+
+// trim_rec returns a node containing the positions in [from, to) of node, where
+// the children outside that range are removed. Nodes completely inside the
+// range are shared, so only the paths to from and to are copied. Leaves are
+// never copied: Bytes outside the range are never read.
+static Node *trim_rec(Node *node, uint32_t shift, uint64_t from, uint64_t to) {
+  if (shift == 0 || (from == 0 && to == capacity(shift))) {
+    return node;
+  }
+  Node *copy = node_clone(node);
+  uint64_t child_size = (uint64_t) 1 << shift;
+  for (uint32_t i = 0; i < PVEC_BRANCHING; i++) {
+    uint64_t start = i * child_size;
+    uint64_t end = start + child_size;
+    if (end <= from || to <= start) {
+      copy->child[i] = NULL;
+    }
+    else {
+      uint64_t child_from = from > start ? from - start : 0;
+      uint64_t child_to = to < end ? to - start : child_size;
+      copy->child[i] = trim_rec(copy->child[i], shift_down(shift), child_from,
+                                child_to);
+    }
+  }
+  return copy;
+}
+
+const BytePvec* byte_pvec_slice(const BytePvec *bpvec, uint32_t from,
+                                uint32_t to) {
+  if (from == to) {
+    return &EMPTY_VECTOR;
+  }
+  BytePvec *clone = byte_pvec_clone(bpvec);
+  clone->size = to - from;
+  // from < to <= bpvec->size, and append keeps offset + size within 32 bits, so
+  // the new offset does not overflow. The last position is computed in 64 bits
+  // all the same.
+  clone->offset = bpvec->offset + from;
+  // Cut the tree until the height is minimal: As long as all the bytes are in
+  // a single child of the root, that child can be the root instead.
+  while (clone->shift > 0) {
+    uint64_t end = (uint64_t) clone->offset + clone->size;
+    uint32_t first = (clone->offset >> clone->shift) & PVEC_MASK;
+    uint32_t last = ((end - 1) >> clone->shift) & PVEC_MASK;
+    if (first != last) {
+      break;
+    }
+    clone->root = clone->root->child[first];
+    clone->offset &= (1u << clone->shift) - 1;
+    clone->shift = shift_down(clone->shift);
+  }
+  clone->root = trim_rec(clone->root, clone->shift, clone->offset,
+                         (uint64_t) clone->offset + clone->size);
+  return (const BytePvec*) clone;
+}
+
+// Inline helper functions
+
+static inline Node *node_clone(const Node *node) {
+  Node *clone = PVEC_MALLOC(sizeof(Node));
+  memcpy(clone, node, sizeof(Node));
+  return clone;
+}
+
+static inline Leaf *leaf_clone(const Leaf *leaf) {
+  Leaf *clone = PVEC_MALLOC_ATOMIC(sizeof(Leaf));
+  memcpy(clone, leaf, sizeof(Leaf));
+  return clone;
+}
+
+static inline BytePvec* byte_pvec_clone(const BytePvec *bpvec) {
+  BytePvec *clone = PVEC_MALLOC(sizeof(BytePvec));
+  memcpy(clone, bpvec, sizeof(BytePvec));
+  return clone;
+}
+
+int main() {
+  // Build a 1 MB buffer in chunks, the way a file would be read.
+  const uint32_t size = 1 << 20;
+  uint8_t chunk[4096];
+  const BytePvec *text = byte_pvec_create();
+  for (uint32_t i = 0; i < size; i += sizeof(chunk)) {
+    for (uint32_t j = 0; j < sizeof(chunk); j++) {
+      chunk[j] = (uint8_t) ('a' + (i + j) % 26);
+    }
+    text = byte_pvec_append(text, chunk, sizeof(chunk));
+  }
+  // Editing a single byte copies one leaf and a path of interior nodes.
+  const BytePvec *edited = byte_pvec_update(text, 1000, '!');
+  // Slicing only keeps the part of the trie covering the slice.
+  const BytePvec *line = byte_pvec_slice(edited, 990, 1010);
+  line = byte_pvec_append(line, (const uint8_t *) "\n", 1);
+
+  int ok = byte_pvec_nth(text, 1000) == 'a' + 1000 % 26 &&
+           byte_pvec_nth(edited, 1000) == '!' &&
+           byte_pvec_count(line) == 21;
+  for (uint32_t i = 0; i < size; i += 4099) {
+    ok = ok && byte_pvec_nth(text, i) == 'a' + i % 26;
+  }
+  if (!ok) {
+    printf("not ok\n");
+  }
+  char str[22] = {0};
+  byte_pvec_copy(line, 0, 21, (uint8_t *) str);
+  printf("%s", str);
+}
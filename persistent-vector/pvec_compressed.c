@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 2014 Jean Niklas L'orange. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * This is the vanilla implementation of a persistent vector where interior
+ * nodes refer to their children through 32-bit references instead of
+ * pointers. On 64-bit machines, that halves the size of interior nodes. The
+ * leaves still contain pointers, as they contain the elements.
+ *
+ * A reference is an index into an arena: Nodes and leaves are allocated from
+ * separate arenas, which are lists of fixed size chunks. Reference 0 is never
+ * handed out, and is used as NULL. Since interior nodes contain no pointers,
+ * their chunks are allocated with PVEC_MALLOC_ATOMIC, and are not scanned by
+ * the garbage collector.
+ *
+ * The price is that the garbage collector cannot see which nodes are in use:
+ * Memory in the arenas is only reclaimed by pvec_compact, which copies the
+ * vectors still in use into new arenas and drops the old ones. The arenas are
+ * not thread safe.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#define COMPRESSED_PVEC
+#include "pvec.h"
+#include "pvec_alloc.h"
+
+// This is an interior trie node. It is always the branching factor size
+// (unused table entries will be 0).
+typedef struct Node {
+  uint32_t child[PVEC_BRANCHING];
+} Node;
+
+// This is a leaf, containing the elements.
+typedef struct Leaf {
+  void *elt[PVEC_BRANCHING];
+} Leaf;
+
+struct _Pvec {
+  // The size of the vector.
+  uint32_t size;
+  // The height of the vector, represented as a shift.
+  uint32_t shift;
+  // The root of the vector. A leaf if shift is 0, an interior node otherwise.
+  uint32_t root;
+};
+
+// CHUNK_BITS is the number of bits of a reference used within a chunk.
+#define CHUNK_BITS 16
+#define CHUNK_SIZE (1 << CHUNK_BITS)
+#define CHUNK_MASK (CHUNK_SIZE - 1)
+
+typedef struct {
+  // The chunks of the arena. Chunks are never moved, so pointers into them stay
+  // valid when new chunks are added.
+  uint8_t **chunks;
+  uint32_t chunk_count;
+  // The next reference to hand out.
+  uint32_t next;
+  // The size of the objects in the arena.
+  uint32_t elt_size;
+  // Whether the objects contain no pointers.
+  int atomic;
+} Arena;
+
+#define NODE_ARENA {.chunks = NULL, .chunk_count = 0, .next = 1, \
+                    .elt_size = sizeof(Node), .atomic = 1}
+#define LEAF_ARENA {.chunks = NULL, .chunk_count = 0, .next = 1, \
+                    .elt_size = sizeof(Leaf), .atomic = 0}
+
+static Arena nodes = NODE_ARENA;
+static Arena leaves = LEAF_ARENA;
+
+// An empty vector. Its root is 0, which works as an empty leaf. (Not
+// necessarily the only empty vector!)
+static Pvec EMPTY_VECTOR = {.size = 0, .shift = 0, .root = 0};
+
+// These are just prototypes -- no need to worry about these.
+static inline Node *node_at(uint32_t ref);
+static inline Leaf *leaf_at(uint32_t ref);
+static inline uint32_t node_clone(uint32_t ref);
+static inline uint32_t leaf_clone(uint32_t ref);
+static inline Pvec* pvec_clone(const Pvec *pvec);
+static inline void *arena_at(const Arena *arena, uint32_t ref);
+static uint32_t arena_alloc(Arena *arena);
+
+// pvec_create just returns the empty vector.
+const Pvec* pvec_create() {
+  return &EMPTY_VECTOR;
+}
+
+// pvec_count just returns the size value inside the vector head.
+uint32_t pvec_count(const Pvec *pvec) {
+  return pvec->size;
+}
+
+void* pvec_nth(const Pvec *pvec, uint32_t index) {
+  uint32_t ref = pvec->root;
+  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
+    ref = node_at(ref)->child[(index >> s) & PVEC_MASK];
+  }
+  return leaf_at(ref)->elt[index & PVEC_MASK];
+}
+
+void* pvec_peek(const Pvec *pvec) {
+  return pvec_nth(pvec, pvec_count(pvec) - 1);
+}
+
+// As we cannot point into the middle of a node with a reference, the functions
+// below walk down the trie with a pointer to the slot containing the reference
+// to the next node, and replace that reference with one to a copy.
+
+const Pvec* pvec_update(const Pvec *restrict pvec, uint32_t index,
+                        const void *restrict elt) {
+  Pvec *clone = pvec_clone(pvec);
+  uint32_t *slot = &clone->root;
+  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
+    *slot = node_clone(*slot);
+    slot = &node_at(*slot)->child[(index >> s) & PVEC_MASK];
+  }
+  *slot = leaf_clone(*slot);
+  leaf_at(*slot)->elt[index & PVEC_MASK] = (void *) elt;
+  return (const Pvec*) clone;
+}
+
+const Pvec* pvec_push(const Pvec *restrict pvec, const void *restrict elt) {
+  Pvec *clone = pvec_clone(pvec);
+  uint32_t index = pvec_count(pvec);
+  clone->size = pvec->size + 1;
+  // this is the d_full(P) check for bit vectors
+  if (pvec_count(pvec) == ((uint64_t) PVEC_BRANCHING << pvec->shift)) {
+    uint32_t new_root = node_clone(0);
+    node_at(new_root)->child[0] = pvec->root;
+    clone->root = new_root;
+    clone->shift = pvec->shift + PVEC_BITS;
+  }
+  else {
+    clone->root = pvec->shift == 0 ? leaf_clone(pvec->root) : node_clone(pvec->root);
+  }
+  // node_clone and leaf_clone create new nodes when given 0, so this is
+  // clone-or-create.
+  uint32_t *slot = &clone->root;
+  for (uint32_t s = clone->shift; s > 0; s -= PVEC_BITS) {
+    slot = &node_at(*slot)->child[(index >> s) & PVEC_MASK];
+    *slot = (s == PVEC_BITS) ? leaf_clone(*slot) : node_clone(*slot);
+  }
+  leaf_at(*slot)->elt[index & PVEC_MASK] = (void *) elt;
+  return (const Pvec*) clone;
+}
+
+const Pvec* pvec_pop(const Pvec *pvec) {
+  Pvec *clone = pvec_clone(pvec);
+  uint32_t index = pvec_count(pvec) - 1;
+  clone->size = pvec_count(pvec) - 1;
+  if (pvec_count(clone) == (1u << pvec->shift) && pvec->shift > 0) {
+    clone->shift = pvec->shift - PVEC_BITS;
+    clone->root = node_at(pvec->root)->child[0];
+    return clone;
+  }
+  uint32_t *slot = &clone->root;
+  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
+    *slot = node_clone(*slot);
+    slot = &node_at(*slot)->child[(index >> s) & PVEC_MASK];
+    if ((index & ((1u << s) - 1)) == 0) {
+      *slot = 0;
+      return clone;
+    }
+  }
+  *slot = leaf_clone(*slot);
+  leaf_at(*slot)->elt[index & PVEC_MASK] = NULL;
+  return clone;
+}
+
+const Pvec* pvec_right_slice(const Pvec *pvec, uint32_t new_size) {
+  Pvec *clone = pvec_clone(pvec);
+  uint32_t index = new_size;
+  clone->size = new_size;
+
+  // We have to cut the tree until the height is minimal
+  while (pvec_count(clone) <= (1u << clone->shift) && clone->shift > 0) {
+    clone->shift = clone->shift - PVEC_BITS;
+    clone->root = node_at(clone->root)->child[0];
+  }
+
+  // The tree being fully dense is a special case, and is short-circuited
+  if (pvec_count(clone) == ((uint64_t) PVEC_BRANCHING << clone->shift)) {
+    return clone;
+  }
+
+  uint32_t *slot = &clone->root;
+  for (uint32_t s = clone->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    *slot = node_clone(*slot);
+    Node *node = node_at(*slot);
+    if ((index & ((1u << s) - 1)) == 0) {
+      memset(&node->child[subindex], 0,
+             (PVEC_BRANCHING - subindex) * sizeof(uint32_t));
+      return clone;
+    }
+    memset(&node->child[subindex + 1], 0,
+           (PVEC_BRANCHING - (subindex + 1)) * sizeof(uint32_t));
+    slot = &node->child[subindex];
+  }
+  uint32_t subindex = index & PVEC_MASK;
+  *slot = leaf_clone(*slot);
+  memset(&leaf_at(*slot)->elt[subindex], 0,
+         (PVEC_BRANCHING - subindex) * sizeof(void *));
+  return clone;
+}
+
+// compact_rec copies the subtree ref, with the given shift, into the arenas in
+// to. fwd maps the references of the subtrees already copied to their copies,
+// so that subtrees shared in the old arenas are shared in the new ones.
+static uint32_t compact_rec(uint32_t ref, uint32_t shift, Arena *to,
+                            uint32_t **fwd) {
+  if (ref == 0) {
+    return 0;
+  }
+  int is_leaf = shift == 0;
+  if (fwd[is_leaf][ref] != 0) {
+    return fwd[is_leaf][ref];
+  }
+  uint32_t copy = arena_alloc(&to[is_leaf]);
+  memcpy(arena_at(&to[is_leaf], copy), is_leaf ? arena_at(&leaves, ref)
+                                               : arena_at(&nodes, ref),
+         to[is_leaf].elt_size);
+  fwd[is_leaf][ref] = copy;
+  if (!is_leaf) {
+    // Chunks never move, so node stays valid while its children are copied.
+    Node *node = arena_at(&to[0], copy);
+    for (uint32_t i = 0; i < PVEC_BRANCHING; i++) {
+      node->child[i] = compact_rec(node->child[i], shift - PVEC_BITS, to, fwd);
+    }
+  }
+  return copy;
+}
+
+void pvec_compact(const Pvec **pvecs, uint32_t n) {
+  Arena to[2] = {NODE_ARENA, LEAF_ARENA};
+  uint32_t *fwd[2];
+  fwd[0] = PVEC_MALLOC_ATOMIC(nodes.next * sizeof(uint32_t));
+  memset(fwd[0], 0, nodes.next * sizeof(uint32_t));
+  fwd[1] = PVEC_MALLOC_ATOMIC(leaves.next * sizeof(uint32_t));
+  memset(fwd[1], 0, leaves.next * sizeof(uint32_t));
+  for (uint32_t i = 0; i < n; i++) {
+    Pvec *clone = pvec_clone(pvecs[i]);
+    clone->root = compact_rec(clone->root, clone->shift, to, fwd);
+    pvecs[i] = clone;
+  }
+  // Nothing refers to the old chunks anymore, so the collector reclaims them.
+  nodes = to[0];
+  leaves = to[1];
+}
+
+// Inline helper functions
+
+static inline void *arena_at(const Arena *arena, uint32_t ref) {
+  return arena->chunks[ref >> CHUNK_BITS] + (ref & CHUNK_MASK) * arena->elt_size;
+}
+
+// arena_alloc returns a reference to a new, nulled object in the arena. New
+// chunks are nulled, as atomic allocations are not.
+static uint32_t arena_alloc(Arena *arena) {
+  if (arena->next == 0) {
+    fprintf(stderr, "pvec: out of 32-bit references\n");
+    abort();
+  }
+  uint32_t ref = arena->next++;
+  if ((ref >> CHUNK_BITS) == arena->chunk_count) {
+    arena->chunks = PVEC_REALLOC(arena->chunks,
+                                 (arena->chunk_count + 1) * sizeof(uint8_t *));
+    size_t chunk_bytes = (size_t) CHUNK_SIZE * arena->elt_size;
+    arena->chunks[arena->chunk_count] = arena->atomic
+      ? PVEC_MALLOC_ATOMIC(chunk_bytes) : PVEC_MALLOC(chunk_bytes);
+    memset(arena->chunks[arena->chunk_count], 0, chunk_bytes);
+    arena->chunk_count++;
+  }
+  return ref;
+}
+
+static inline Node *node_at(uint32_t ref) {
+  return arena_at(&nodes, ref);
+}
+
+static inline Leaf *leaf_at(uint32_t ref) {
+  return arena_at(&leaves, ref);
+}
+
+// node_clone returns a reference to a copy of the node, or to a new node if ref
+// is 0.
+static inline uint32_t node_clone(uint32_t ref) {
+  uint32_t clone = arena_alloc(&nodes);
+  if (ref != 0) {
+    memcpy(node_at(clone), node_at(ref), sizeof(Node));
+  }
+  return clone;
+}
+
+// leaf_clone returns a reference to a copy of the leaf, or to a new leaf if ref
+// is 0.
+static inline uint32_t leaf_clone(uint32_t ref) {
+  uint32_t clone = arena_alloc(&leaves);
+  if (ref != 0) {
+    memcpy(leaf_at(clone), leaf_at(ref), sizeof(Leaf));
+  }
+  return clone;
+}
+
+static inline Pvec* pvec_clone(const Pvec *pvec) {
+  Pvec *clone = PVEC_MALLOC(sizeof(Pvec));
+  memcpy(clone, pvec, sizeof(Pvec));
+  return clone;
+}
+
+int main() {
+  const Pvec *p = pvec_create();
+  for (uintptr_t i = 0; i < 100; i++) {
+    p = pvec_push(p, (void *) (i + 1));
+    int ok = 1;
+    for (uint32_t j = 0; j <= i; j++) {
+      uintptr_t n = (uintptr_t) pvec_nth(p, j);
+      if (n != j + 1) {
+        ok = 0;
+      }
+    }
+    if (!ok) {
+      printf("For %lu, not ok\n", i);
+    }
+  }
+  for (uint32_t i = 0; i <= 100; i++) {
+    const Pvec *q = pvec_right_slice(p, i);
+    for (uint32_t j = 0; j < i; j++) {
+      if ((uintptr_t) pvec_nth(q, j) != j + 1) {
+        printf("Slice to %u, not ok\n", i);
+      }
+    }
+  }
+  printf("Interior nodes are %zu bytes, %u have been allocated\n",
+         sizeof(Node), nodes.next - 1);
+
+  // Only keep p: Every other version is dropped from the arenas.
+  const Pvec *keep[1] = {p};
+  pvec_compact(keep, 1);
+  p = keep[0];
+  for (uint32_t j = 0; j < 100; j++) {
+    if ((uintptr_t) pvec_nth(p, j) != j + 1) {
+      printf("Compacted %u, not ok\n", j);
+    }
+  }
+  printf("After compaction, %u interior nodes are allocated\n",
+         nodes.next - 1);
+}
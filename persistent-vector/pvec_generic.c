@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2014 Jean Niklas L'orange. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Example usage of pvec_generic.h: Two persistent vectors with different
+ * branching factors in the same program.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define PVEC_TEMPLATE_IMPLEMENTATION
+
+// b = 2: Cheap to update, as every copied node is only 4 pointers wide.
+#define PVEC_TEMPLATE_TYPE Pvec2
+#define PVEC_TEMPLATE_PREFIX pvec2
+#define PVEC_TEMPLATE_BITS 2
+#include "pvec_generic.h"
+
+// b = 5: Shallow tries, for large vectors which are mostly read.
+#define PVEC_TEMPLATE_TYPE Pvec5
+#define PVEC_TEMPLATE_PREFIX pvec5
+#define PVEC_TEMPLATE_BITS 5
+#include "pvec_generic.h"
+
+int main() {
+  const Pvec2 *small = pvec2_create();
+  const Pvec5 *large = pvec5_create();
+  for (uintptr_t i = 0; i < 1000; i++) {
+    small = pvec2_push(small, (void *) (i + 1));
+    large = pvec5_push(large, (void *) (i + 1));
+  }
+  for (uint32_t i = 0; i < 1000; i++) {
+    if ((uintptr_t) pvec2_nth(small, i) != i + 1 ||
+        (uintptr_t) pvec5_nth(large, i) != i + 1) {
+      printf("For %u, not ok\n", i);
+    }
+  }
+  small = pvec2_right_slice(small, 10);
+  large = pvec5_pop(pvec5_update(large, 3, (void *) 0));
+  printf("sizes: %u and %u\n", pvec2_count(small), pvec5_count(large));
+}
@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2014 Jean Niklas L'orange. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * This is the vanilla persistent vector as a "template": Every time this file
+ * is included, it generates a persistent vector type with its own branching
+ * factor and its own function prefix. That way, a program can use small
+ * branching factors for small vectors which are updated often, and large ones
+ * for large vectors, without separate builds. pvec_vanilla.c is itself an
+ * instance, with the prefix pvec and b = PVEC_BITS.
+ *
+ * Before including this file, define
+ *
+ *   PVEC_TEMPLATE_TYPE    the name of the vector type, e.g. Pvec5
+ *   PVEC_TEMPLATE_PREFIX  the prefix of the functions, e.g. pvec5
+ *   PVEC_TEMPLATE_BITS    b, the number of bits used per node in the trie
+ *
+ * and optionally
+ *
+ *   PVEC_TEMPLATE_STRUCT  the tag of the vector head struct, if the type is
+ *                         already declared as an opaque struct elsewhere
+ *   PVEC_TEMPLATE_STATS   to time the operations with pvec_stats.h, which has
+ *                         to be included first
+ *
+ * This declares the type and the functions, e.g. pvec5_push. Define
+ * PVEC_TEMPLATE_IMPLEMENTATION as well in exactly one translation unit to also
+ * emit the definitions. The parameters are undefined at the end of this file,
+ * so it can be included again right away with other parameters.
+ */
+
+#if !defined(PVEC_TEMPLATE_TYPE) || !defined(PVEC_TEMPLATE_PREFIX) || \
+    !defined(PVEC_TEMPLATE_BITS)
+#error "PVEC_TEMPLATE_TYPE, PVEC_TEMPLATE_PREFIX and PVEC_TEMPLATE_BITS must be defined"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef PVEC_GENERIC_H
+#define PVEC_GENERIC_H
+#define PVEC_T_CAT2(a, b) a##_##b
+#define PVEC_T_CAT(a, b) PVEC_T_CAT2(a, b)
+#endif
+
+#define PVEC_T_FN(name) PVEC_T_CAT(PVEC_TEMPLATE_PREFIX, name)
+#define PVEC_T_NODE PVEC_T_CAT(PVEC_TEMPLATE_PREFIX, node)
+#define PVEC_T_BITS PVEC_TEMPLATE_BITS
+#define PVEC_T_BRANCHING (1 << PVEC_T_BITS)
+#define PVEC_T_MASK (PVEC_T_BRANCHING - 1)
+#define PVEC_T_MAX_HEIGHT ((32 + PVEC_T_BITS - 1) / PVEC_T_BITS)
+
+#ifdef PVEC_TEMPLATE_STRUCT
+#define PVEC_T_HEAD PVEC_TEMPLATE_STRUCT
+#else
+#define PVEC_T_HEAD PVEC_T_CAT(PVEC_TEMPLATE_PREFIX, head)
+// An opaque persistent vector struct.
+typedef struct PVEC_T_HEAD PVEC_TEMPLATE_TYPE;
+#endif
+
+const PVEC_TEMPLATE_TYPE* PVEC_T_FN(create)(void);
+uint32_t PVEC_T_FN(count)(const PVEC_TEMPLATE_TYPE *pvec);
+void* PVEC_T_FN(nth)(const PVEC_TEMPLATE_TYPE *pvec, uint32_t index);
+const PVEC_TEMPLATE_TYPE* PVEC_T_FN(pop)(const PVEC_TEMPLATE_TYPE *pvec);
+void* PVEC_T_FN(peek)(const PVEC_TEMPLATE_TYPE *pvec);
+const PVEC_TEMPLATE_TYPE* PVEC_T_FN(push)(const PVEC_TEMPLATE_TYPE *restrict pvec,
+                                          const void *restrict elt);
+const PVEC_TEMPLATE_TYPE* PVEC_T_FN(push_many)(const PVEC_TEMPLATE_TYPE *restrict pvec,
+                                               void *const *restrict elts,
+                                               uint32_t k);
+const PVEC_TEMPLATE_TYPE* PVEC_T_FN(update)(const PVEC_TEMPLATE_TYPE *restrict pvec,
+                                            uint32_t index, const void *restrict elt);
+const PVEC_TEMPLATE_TYPE* PVEC_T_FN(right_slice)(const PVEC_TEMPLATE_TYPE *pvec,
+                                                 uint32_t new_size);
+
+#ifdef PVEC_TEMPLATE_IMPLEMENTATION
+
+#include "pvec_alloc.h"
+
+#ifdef PVEC_TEMPLATE_STATS
+#define PVEC_T_BEGIN PVEC_STATS_BEGIN
+#define PVEC_T_END(op, val) PVEC_STATS_END(op, val)
+#else
+#define PVEC_T_BEGIN
+#define PVEC_T_END(op, val) (val)
+#endif
+
+// This is a trie node. It is always the branching factor size (unused table
+// entries will be NULL).
+typedef struct PVEC_T_NODE {
+  PVEC_NODE_ALIGN struct PVEC_T_NODE *child[PVEC_T_BRANCHING];
+} PVEC_T_NODE;
+
+struct PVEC_T_HEAD {
+  // The size of the vector.
+  uint32_t size;
+  // The height of the vector, represented as a shift.
+  uint32_t shift;
+  // The root of the vector.
+  PVEC_T_NODE *root;
+};
+
+static PVEC_T_NODE PVEC_T_FN(empty_node) = {.child = {0}};
+
+// An empty vector. (Not necessarily the only empty vector!)
+static PVEC_TEMPLATE_TYPE PVEC_T_FN(empty_vector) =
+  {.size = 0, .shift = 0, .root = &PVEC_T_FN(empty_node)};
+
+static inline PVEC_T_NODE *PVEC_T_FN(node_create)(void) {
+  return PVEC_MALLOC_NODE(sizeof(PVEC_T_NODE));
+}
+
+static inline PVEC_T_NODE *PVEC_T_FN(node_clone)(const PVEC_T_NODE *node) {
+  PVEC_T_NODE *clone = PVEC_MALLOC_NODE(sizeof(PVEC_T_NODE));
+  memcpy(clone, node, sizeof(PVEC_T_NODE));
+  return clone;
+}
+
+static inline PVEC_TEMPLATE_TYPE *PVEC_T_FN(clone)(const PVEC_TEMPLATE_TYPE *pvec) {
+  PVEC_TEMPLATE_TYPE *clone = PVEC_MALLOC(sizeof(PVEC_TEMPLATE_TYPE));
+  memcpy(clone, pvec, sizeof(PVEC_TEMPLATE_TYPE));
+  return clone;
+}
+
+// create just returns the empty vector.
+const PVEC_TEMPLATE_TYPE* PVEC_T_FN(create)(void) {
+  return &PVEC_T_FN(empty_vector);
+}
+
+// count just returns the size value inside the vector head.
+uint32_t PVEC_T_FN(count)(const PVEC_TEMPLATE_TYPE *pvec) {
+  return pvec->size;
+}
+
+// The *_head functions below contain the actual operations. They take a copy of
+// the original head and modify it to represent the new version, copying the
+// nodes they change. The functions returning pointers put the copy on the heap,
+// pvec_vanilla.c's value API (pvec_val_*) keeps it on the stack.
+
+static inline void *PVEC_T_FN(nth_head)(const PVEC_TEMPLATE_TYPE *pvec,
+                                        uint32_t index) {
+  PVEC_T_NODE *node = pvec->root;
+  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_T_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_T_MASK;
+    node = node->child[subindex];
+  }
+  // This last call is here because unsigned integers cannot be negative, thus
+  // `s >= 0` will always be true.
+  return (void *) node->child[index & PVEC_T_MASK];
+}
+
+void* PVEC_T_FN(nth)(const PVEC_TEMPLATE_TYPE *pvec, uint32_t index) {
+  PVEC_T_BEGIN;
+  void *elt = PVEC_T_FN(nth_head)(pvec, index);
+  return PVEC_T_END(PVEC_OP_NTH, elt);
+}
+
+void* PVEC_T_FN(peek)(const PVEC_TEMPLATE_TYPE *pvec) {
+  return PVEC_T_FN(nth)(pvec, pvec->size - 1);
+}
+
+static void PVEC_T_FN(update_head)(PVEC_TEMPLATE_TYPE *clone, uint32_t index,
+                                   const void *elt) {
+  PVEC_T_NODE *node = PVEC_T_FN(node_clone)(clone->root);
+  clone->root = node;
+  for (uint32_t s = clone->shift; s > 0; s -= PVEC_T_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_T_MASK;
+    node->child[subindex] = PVEC_T_FN(node_clone)(node->child[subindex]);
+    node = node->child[subindex];
+  }
+  uint32_t subindex = index & PVEC_T_MASK;
+  node->child[subindex] = (PVEC_T_NODE *) elt;
+}
+
+const PVEC_TEMPLATE_TYPE* PVEC_T_FN(update)(const PVEC_TEMPLATE_TYPE *restrict pvec,
+                                            uint32_t index, const void *restrict elt) {
+  PVEC_T_BEGIN;
+  PVEC_TEMPLATE_TYPE *clone = PVEC_T_FN(clone)(pvec);
+  PVEC_T_FN(update_head)(clone, index, elt);
+  return PVEC_T_END(PVEC_OP_UPDATE, (const PVEC_TEMPLATE_TYPE*) clone);
+}
+
+// push_head is equivalent to the append function described in Section 2.5, but
+// with bitwise access tricks.
+static void PVEC_T_FN(push_head)(PVEC_TEMPLATE_TYPE *clone, const void *elt) {
+  uint32_t index = clone->size;
+  // this is the d_full(P) check for bit vectors
+  if (clone->size == ((uint64_t) PVEC_T_BRANCHING << clone->shift)) {
+    PVEC_T_NODE *new_root = PVEC_T_FN(node_create)();
+    new_root->child[0] = clone->root;
+    clone->root = new_root;
+    clone->shift = clone->shift + PVEC_T_BITS;
+  }
+  else {
+    clone->root = PVEC_T_FN(node_clone)(clone->root);
+  }
+  clone->size = index + 1;
+  PVEC_T_NODE *node = clone->root;
+  for (uint32_t s = clone->shift; s > 0; s -= PVEC_T_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_T_MASK;
+    if (node->child[subindex] == NULL) { // the create part of clone-or-create
+      node->child[subindex] = PVEC_T_FN(node_create)();
+    }
+    else { // the clone part of clone-or-create
+      node->child[subindex] = PVEC_T_FN(node_clone)(node->child[subindex]);
+    }
+    node = node->child[subindex];
+  }
+  uint32_t subindex = index & PVEC_T_MASK;
+  node->child[subindex] = (PVEC_T_NODE *) elt;
+}
+
+const PVEC_TEMPLATE_TYPE* PVEC_T_FN(push)(const PVEC_TEMPLATE_TYPE *restrict pvec,
+                                          const void *restrict elt) {
+  PVEC_T_BEGIN;
+  PVEC_TEMPLATE_TYPE *clone = PVEC_T_FN(clone)(pvec);
+  PVEC_T_FN(push_head)(clone, elt);
+  return PVEC_T_END(PVEC_OP_PUSH, (const PVEC_TEMPLATE_TYPE*) clone);
+}
+
+// push_many_rec returns a copy of node (or a new node if node is NULL) where
+// the k elements in elts are placed from index and onwards. index is relative
+// to the subtree node represents. Every node is copied or created exactly once,
+// so filling a subtree costs one allocation per node in the result.
+static PVEC_T_NODE *PVEC_T_FN(push_many_rec)(const PVEC_T_NODE *node, uint32_t shift,
+                                             uint32_t index, void *const *elts,
+                                             uint32_t k) {
+  PVEC_T_NODE *copy = (node == NULL) ? PVEC_T_FN(node_create)()
+                                     : PVEC_T_FN(node_clone)(node);
+  if (shift == 0) {
+    memcpy(&copy->child[index], elts, k * sizeof(PVEC_T_NODE *));
+    return copy;
+  }
+  while (k > 0) {
+    uint32_t subindex = (index >> shift) & PVEC_T_MASK;
+    uint32_t offset = index & ((1u << shift) - 1);
+    uint32_t n = (1u << shift) - offset;
+    if (k < n) {
+      n = k;
+    }
+    copy->child[subindex] = PVEC_T_FN(push_many_rec)(copy->child[subindex],
+                                                     shift - PVEC_T_BITS,
+                                                     offset, elts, n);
+    index += n;
+    elts += n;
+    k -= n;
+  }
+  return copy;
+}
+
+// push_many is equivalent to k consecutive push calls, but fills up whole
+// leaves at a time instead of cloning the rightmost path once per element.
+const PVEC_TEMPLATE_TYPE* PVEC_T_FN(push_many)(const PVEC_TEMPLATE_TYPE *restrict pvec,
+                                               void *const *restrict elts,
+                                               uint32_t k) {
+  if (k == 0) {
+    return pvec;
+  }
+  PVEC_TEMPLATE_TYPE *clone = PVEC_T_FN(clone)(pvec);
+  clone->size = pvec->size + k;
+  // If the trie has to grow, we stack allocate the new root candidates: They
+  // are all on the path we insert into, so push_many_rec will copy each one of
+  // them onto the heap.
+  PVEC_T_NODE grown[PVEC_T_MAX_HEIGHT];
+  PVEC_T_NODE *root = pvec->root;
+  while (clone->size > ((uint64_t) PVEC_T_BRANCHING << clone->shift)) {
+    PVEC_T_NODE *new_root = &grown[clone->shift / PVEC_T_BITS];
+    memset(new_root, 0, sizeof(PVEC_T_NODE));
+    new_root->child[0] = root;
+    root = new_root;
+    clone->shift += PVEC_T_BITS;
+  }
+  clone->root = PVEC_T_FN(push_many_rec)(root, clone->shift, pvec->size, elts, k);
+  return (const PVEC_TEMPLATE_TYPE*) clone;
+}
+
+static void PVEC_T_FN(pop_head)(PVEC_TEMPLATE_TYPE *clone) {
+  uint32_t index = clone->size - 1;
+  clone->size = index;
+  if (clone->size == (1u << clone->shift) && clone->shift > 0) {
+    clone->shift = clone->shift - PVEC_T_BITS;
+    clone->root = clone->root->child[0];
+  }
+  else {
+    PVEC_T_NODE *node = PVEC_T_FN(node_clone)(clone->root);
+    clone->root = node;
+    for (uint32_t s = clone->shift; s > 0; s -= PVEC_T_BITS) {
+      uint32_t subindex = (index >> s) & PVEC_T_MASK;
+      if ((index & ((1u << s) - 1)) == 0) {
+        node->child[subindex] = NULL;
+        return;
+      }
+      else {
+        node->child[subindex] = PVEC_T_FN(node_clone)(node->child[subindex]);
+        node = node->child[subindex];
+      }
+    }
+    node->child[index & PVEC_T_MASK] = NULL;
+  }
+}
+
+const PVEC_TEMPLATE_TYPE* PVEC_T_FN(pop)(const PVEC_TEMPLATE_TYPE *pvec) {
+  PVEC_T_BEGIN;
+  PVEC_TEMPLATE_TYPE *clone = PVEC_T_FN(clone)(pvec);
+  PVEC_T_FN(pop_head)(clone);
+  return PVEC_T_END(PVEC_OP_POP, (const PVEC_TEMPLATE_TYPE*) clone);
+}
+
+// Performing a right slice on a persistent vector. Implemented in Scala (with
+// displays), but not in Clojure.
+static void PVEC_T_FN(right_slice_head)(PVEC_TEMPLATE_TYPE *clone,
+                                        uint32_t new_size) {
+  uint32_t index = new_size;
+  clone->size = new_size;
+
+  // We have to cut the tree until the height is minimal
+  while (clone->size <= (1u << clone->shift) && clone->shift > 0) {
+    clone->shift = clone->shift - PVEC_T_BITS;
+    clone->root = clone->root->child[0];
+  }
+
+  // The tree being fully dense is a special case, and is short-circuited
+  if (clone->size == ((uint64_t) PVEC_T_BRANCHING << clone->shift)) {
+    return;
+  }
+
+  // Notice that this part is almost exactly the same as the `else` part within
+  // pop_head. The only difference is the memset functions to ensure that all
+  // elements right of the trie to walk is nilled through the memset function.
+  PVEC_T_NODE *node = PVEC_T_FN(node_clone)(clone->root);
+  clone->root = node;
+  for (uint32_t s = clone->shift; s > 0; s -= PVEC_T_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_T_MASK;
+    if ((index & ((1u << s) - 1)) == 0) {
+      memset(&node->child[subindex], 0,
+             (PVEC_T_BRANCHING - subindex) * sizeof(PVEC_T_NODE *));
+      return;
+    }
+    else {
+      node->child[subindex] = PVEC_T_FN(node_clone)(node->child[subindex]);
+      memset(&node->child[subindex + 1], 0,
+             (PVEC_T_BRANCHING - (subindex + 1)) * sizeof(PVEC_T_NODE *));
+      node = node->child[subindex];
+    }
+  }
+  uint32_t subindex = index & PVEC_T_MASK;
+  memset(&node->child[subindex], 0,
+         (PVEC_T_BRANCHING - subindex) * sizeof(PVEC_T_NODE *));
+}
+
+const PVEC_TEMPLATE_TYPE* PVEC_T_FN(right_slice)(const PVEC_TEMPLATE_TYPE *pvec,
+                                                 uint32_t new_size) {
+  PVEC_T_BEGIN;
+  PVEC_TEMPLATE_TYPE *clone = PVEC_T_FN(clone)(pvec);
+  PVEC_T_FN(right_slice_head)(clone, new_size);
+  return PVEC_T_END(PVEC_OP_RIGHT_SLICE, (const PVEC_TEMPLATE_TYPE*) clone);
+}
+
+#undef PVEC_T_BEGIN
+#undef PVEC_T_END
+
+#endif
+
+#undef PVEC_T_FN
+#undef PVEC_T_NODE
+#undef PVEC_T_HEAD
+#undef PVEC_T_BITS
+#undef PVEC_T_BRANCHING
+#undef PVEC_T_MASK
+#undef PVEC_T_MAX_HEIGHT
+#undef PVEC_TEMPLATE_TYPE
+#undef PVEC_TEMPLATE_PREFIX
+#undef PVEC_TEMPLATE_BITS
+#undef PVEC_TEMPLATE_STRUCT
+#undef PVEC_TEMPLATE_STATS
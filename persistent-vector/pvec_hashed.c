@@ -0,0 +1,572 @@
+/*
+ * Copyright (c) 2014 Jean Niklas L'orange. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * This is the vanilla implementation of a persistent vector where every node
+ * caches a hash of its subtree, i.e. a Merkle tree. Only the nodes on the path
+ * an operation copies change, so the hashes are recomputed for those nodes
+ * only, bottom up, after the operation is done.
+ *
+ * For the hashes to be the same for equal vectors, the tries must be the same
+ * shape: Unused table entries are always NULL, and a subtree is removed as
+ * soon as it contains no elements.
+ *
+ * The hashes are also used to synchronise a replica with a primary: The
+ * replica walks the trie of the primary from the root, and only asks for the
+ * nodes whose hashes differ from the node at the same position in its own
+ * version. A replica k updates behind thus receives O(k log n) nodes.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define HASHED_PVEC
+#include "pvec.h"
+#include "pvec_alloc.h"
+
+// This is a trie node. It is always the branching factor size (unused table
+// entries will be NULL).
+typedef struct Node {
+  // The hash of the subtree. Empty subtrees hash to 0.
+  uint64_t hash;
+  struct Node *child[PVEC_BRANCHING];
+} Node;
+
+struct _Pvec {
+  // The size of the vector.
+  uint32_t size;
+  // The height of the vector, represented as a shift.
+  uint32_t shift;
+  // The root of the vector.
+  Node* root;
+};
+
+static Node EMPTY_NODE = {.hash = 0, .child = {0}};
+
+// An empty vector. (Not necessarily the only empty vector!)
+static Pvec EMPTY_VECTOR = {.size = 0, .shift = 0, .root = &EMPTY_NODE};
+
+// These are just prototypes -- no need to worry about these.
+static inline Node *node_create(void);
+static inline Node *node_clone(const Node* node);
+static inline Pvec* pvec_clone(const Pvec *pvec);
+static inline void node_rehash(Node *node, uint32_t shift, uint32_t count);
+static void rehash_path(Node **path, uint32_t length, const Pvec *pvec,
+                        uint32_t index);
+
+// hash_mix is the 64-bit finaliser of MurmurHash3. It maps 0 to 0.
+static inline uint64_t hash_mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+#ifndef PVEC_HASH_ELT
+// PVEC_HASH_ELT hashes an element. Elements are compared by pointer value, so
+// by default we hash the pointer.
+#define PVEC_HASH_ELT(elt) hash_mix((uintptr_t) (elt))
+#endif
+
+// pvec_create just returns the empty vector.
+const Pvec* pvec_create() {
+  return &EMPTY_VECTOR;
+}
+
+// pvec_count just returns the size value inside the vector head.
+uint32_t pvec_count(const Pvec *pvec) {
+  return pvec->size;
+}
+
+uint64_t pvec_hash(const Pvec *pvec) {
+  return hash_mix(pvec->root->hash ^ (0x9e3779b97f4a7c15ULL * pvec->size));
+}
+
+void* pvec_nth(const Pvec *pvec, uint32_t index) {
+  Node *node = pvec->root;
+  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    node = node->child[subindex];
+  }
+  return (void *) node->child[index & PVEC_MASK];
+}
+
+void* pvec_peek(const Pvec *pvec) {
+  return pvec_nth(pvec, pvec_count(pvec) - 1);
+}
+
+// The functions below are the vanilla ones, except that they remember the path
+// of nodes they have copied, so that its hashes can be recomputed at the end.
+
+const Pvec* pvec_update(const Pvec *restrict pvec, uint32_t index,
+                        const void *restrict elt) {
+  Node *path[PVEC_MAX_HEIGHT + 1];
+  uint32_t length = 0;
+  Pvec *clone = pvec_clone(pvec);
+  Node *node = node_clone(pvec->root);
+  clone->root = node;
+  path[length++] = node;
+  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    node->child[subindex] = node_clone(node->child[subindex]);
+    node = node->child[subindex];
+    path[length++] = node;
+  }
+  node->child[index & PVEC_MASK] = (Node *) elt;
+  rehash_path(path, length, clone, index);
+  return (const Pvec*) clone;
+}
+
+const Pvec* pvec_push(const Pvec *restrict pvec, const void *restrict elt) {
+  Node *path[PVEC_MAX_HEIGHT + 1];
+  uint32_t length = 0;
+  Pvec *clone = pvec_clone(pvec);
+  uint32_t index = pvec_count(pvec);
+  clone->size = pvec->size + 1;
+  // this is the d_full(P) check for bit vectors
+  if (pvec_count(pvec) == ((uint64_t) PVEC_BRANCHING << pvec->shift)) {
+    Node *new_root = node_create();
+    new_root->child[0] = pvec->root;
+    clone->root = new_root;
+    clone->shift = pvec->shift + PVEC_BITS;
+  }
+  else {
+    clone->root = node_clone(pvec->root);
+  }
+  Node *node = clone->root;
+  path[length++] = node;
+  for (uint32_t s = clone->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    if (node->child[subindex] == NULL) { // the create part of clone-or-create
+      node->child[subindex] = node_create();
+    }
+    else { // the clone part of clone-or-create
+      node->child[subindex] = node_clone(node->child[subindex]);
+    }
+    node = node->child[subindex];
+    path[length++] = node;
+  }
+  node->child[index & PVEC_MASK] = (Node *) elt;
+  rehash_path(path, length, clone, index);
+  return (const Pvec*) clone;
+}
+
+const Pvec* pvec_pop(const Pvec *pvec) {
+  Node *path[PVEC_MAX_HEIGHT + 1];
+  uint32_t length = 0;
+  Pvec *clone = pvec_clone(pvec);
+  uint32_t index = pvec_count(pvec) - 1;
+  clone->size = pvec_count(pvec) - 1;
+  if (pvec_count(clone) == (1u << pvec->shift) && pvec->shift > 0) {
+    clone->shift = pvec->shift - PVEC_BITS;
+    clone->root = pvec->root->child[0];
+    return clone;
+  }
+  Node *node = node_clone(pvec->root);
+  clone->root = node;
+  path[length++] = node;
+  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    if ((index & ((1u << s) - 1)) == 0) {
+      // The last element is the only element in this subtree.
+      node->child[subindex] = NULL;
+      rehash_path(path, length, clone, index);
+      return clone;
+    }
+    node->child[subindex] = node_clone(node->child[subindex]);
+    node = node->child[subindex];
+    path[length++] = node;
+  }
+  node->child[index & PVEC_MASK] = NULL;
+  rehash_path(path, length, clone, index);
+  return clone;
+}
+
+const Pvec* pvec_right_slice(const Pvec *pvec, uint32_t new_size) {
+  Node *path[PVEC_MAX_HEIGHT + 1];
+  uint32_t length = 0;
+  Pvec *clone = pvec_clone(pvec);
+  uint32_t index = new_size;
+  clone->size = new_size;
+
+  // We have to cut the tree until the height is minimal
+  while (pvec_count(clone) <= (1u << clone->shift) && clone->shift > 0) {
+    clone->shift = clone->shift - PVEC_BITS;
+    clone->root = clone->root->child[0];
+  }
+
+  // The tree being fully dense is a special case, and is short-circuited
+  if (pvec_count(clone) == ((uint64_t) PVEC_BRANCHING << clone->shift)) {
+    return clone;
+  }
+
+  Node *node = node_clone(clone->root);
+  clone->root = node;
+  path[length++] = node;
+  for (uint32_t s = clone->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    if ((index & ((1u << s) - 1)) == 0) {
+      memset(&node->child[subindex], 0,
+             (PVEC_BRANCHING - subindex) * sizeof(Node *));
+      rehash_path(path, length, clone, index);
+      return clone;
+    }
+    node->child[subindex] = node_clone(node->child[subindex]);
+    memset(&node->child[subindex + 1], 0,
+           (PVEC_BRANCHING - (subindex + 1)) * sizeof(Node *));
+    node = node->child[subindex];
+    path[length++] = node;
+  }
+  uint32_t subindex = index & PVEC_MASK;
+  memset(&node->child[subindex], 0,
+         (PVEC_BRANCHING - subindex) * sizeof(Node *));
+  rehash_path(path, length, clone, index);
+  return clone;
+}
+
+// node_equals compares the first size elements in the subtrees a and b. Both
+// subtrees have the given shift. Subtrees with different hashes are never
+// equal, and shared subtrees always are, so neither have to be walked.
+static int node_equals(const Node *a, const Node *b, uint32_t shift,
+                       uint32_t size) {
+  if (a == b) {
+    return 1;
+  }
+  if (a->hash != b->hash) {
+    return 0;
+  }
+  if (shift == 0) {
+    return memcmp(a->child, b->child, size * sizeof(Node *)) == 0;
+  }
+  uint32_t child_size = 1u << shift;
+  for (uint32_t i = 0; size > 0; i++) {
+    uint32_t n = size < child_size ? size : child_size;
+    if (!node_equals(a->child[i], b->child[i], shift - PVEC_BITS, n)) {
+      return 0;
+    }
+    size -= n;
+  }
+  return 1;
+}
+
+int pvec_equals(const Pvec *a, const Pvec *b) {
+  if (a == b) {
+    return 1;
+  }
+  // The tries have the same shape if the sizes are equal.
+  if (a->size != b->size) {
+    return 0;
+  }
+  return node_equals(a->root, b->root, a->shift, a->size);
+}
+
+// Synchronisation. The protocol is as follows: The primary starts by sending a
+// SyncHead with the size, shift and root hash of its vector. The replica then
+// sends a SyncRequest for every node it needs, and the primary answers each
+// one with the PVEC_BRANCHING entries of that node: Child hashes for interior
+// nodes, elements for leaves. A SyncRequest with shift SYNC_DONE ends the
+// session. Both ends are expected to have the same byte order.
+
+#define SYNC_DONE UINT32_MAX
+
+typedef struct {
+  uint32_t size;
+  uint32_t shift;
+  uint64_t hash;
+} SyncHead;
+
+typedef struct {
+  // The index of the first element in the node.
+  uint32_t index;
+  // The shift of the node.
+  uint32_t shift;
+} SyncRequest;
+
+static int read_full(int fd, void *buf, size_t len) {
+  uint8_t *ptr = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, ptr, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    ptr += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+  const uint8_t *ptr = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, ptr, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    ptr += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// valid_shift returns 1 if shift is the shift of some level in a trie, and 0
+// otherwise. Shifts come from the peer, and must be checked before they are
+// used to walk a trie.
+static int valid_shift(uint32_t shift) {
+  return shift % PVEC_BITS == 0 && shift / PVEC_BITS < PVEC_MAX_HEIGHT;
+}
+
+// node_at returns the node with the given shift containing index, or NULL if
+// the trie has no such node.
+static const Node *node_at(const Pvec *pvec, uint32_t index, uint32_t shift) {
+  if (!valid_shift(shift) || shift > pvec->shift ||
+      (uint64_t) index >= ((uint64_t) PVEC_BRANCHING << pvec->shift)) {
+    return NULL;
+  }
+  const Node *node = pvec->root;
+  for (uint32_t s = pvec->shift; s > shift && node != NULL; s -= PVEC_BITS) {
+    node = node->child[(index >> s) & PVEC_MASK];
+  }
+  return node;
+}
+
+int64_t pvec_sync_serve(const Pvec *pvec, int in_fd, int out_fd) {
+  SyncHead head = {.size = pvec->size, .shift = pvec->shift,
+                   .hash = pvec->root->hash};
+  if (write_full(out_fd, &head, sizeof(head)) < 0) {
+    return -1;
+  }
+  int64_t sent = 0;
+  SyncRequest req;
+  while (read_full(in_fd, &req, sizeof(req)) == 0) {
+    if (req.shift == SYNC_DONE) {
+      return sent;
+    }
+    const Node *node = node_at(pvec, req.index, req.shift);
+    if (node == NULL) {
+      return -1;
+    }
+    uint64_t entries[PVEC_BRANCHING];
+    for (uint32_t i = 0; i < PVEC_BRANCHING; i++) {
+      if (req.shift == 0) {
+        entries[i] = (uintptr_t) node->child[i];
+      }
+      else {
+        entries[i] = node->child[i] == NULL ? 0 : node->child[i]->hash;
+      }
+    }
+    if (write_full(out_fd, entries, sizeof(entries)) < 0) {
+      return -1;
+    }
+    sent++;
+  }
+  return -1;
+}
+
+// fetch_rec returns the node with the given shift containing index in the
+// vector of the primary, which has the given hash. size is the size of the
+// primary vector. If local has a node with the same hash at that position, it
+// is used instead of fetching it. Returns NULL on errors.
+static Node *fetch_rec(const Pvec *local, uint32_t size, uint32_t index,
+                       uint32_t shift, uint64_t hash, int in_fd, int out_fd) {
+  const Node *own = node_at(local, index, shift);
+  if (own != NULL && own->hash == hash) {
+    return (Node *) own;
+  }
+  SyncRequest req = {.index = index, .shift = shift};
+  uint64_t entries[PVEC_BRANCHING];
+  if (write_full(out_fd, &req, sizeof(req)) < 0 ||
+      read_full(in_fd, entries, sizeof(entries)) < 0) {
+    return NULL;
+  }
+  Node *node = node_create();
+  for (uint32_t i = 0; i < PVEC_BRANCHING; i++) {
+    if (shift == 0) {
+      node->child[i] = (Node *) (uintptr_t) entries[i];
+      continue;
+    }
+    // Children are present if and only if they contain elements.
+    uint64_t child_index = index + ((uint64_t) i << shift);
+    if (child_index >= size) {
+      break;
+    }
+    node->child[i] = fetch_rec(local, size, (uint32_t) child_index,
+                               shift - PVEC_BITS, entries[i], in_fd, out_fd);
+    if (node->child[i] == NULL) {
+      return NULL;
+    }
+  }
+  uint32_t count = size - index < PVEC_BRANCHING ? size - index : PVEC_BRANCHING;
+  node_rehash(node, shift, count);
+  return node->hash == hash ? node : NULL;
+}
+
+const Pvec* pvec_sync_fetch(const Pvec *local, int in_fd, int out_fd) {
+  SyncHead head;
+  if (read_full(in_fd, &head, sizeof(head)) < 0) {
+    return NULL;
+  }
+  Pvec *result = NULL;
+  if (head.size == 0) {
+    result = (Pvec *) &EMPTY_VECTOR;
+  }
+  // The trie of the primary must have the minimal height for its size.
+  else if (valid_shift(head.shift) &&
+           head.size <= ((uint64_t) PVEC_BRANCHING << head.shift) &&
+           (head.shift == 0 || head.size > ((uint64_t) 1 << head.shift))) {
+    Node *root = fetch_rec(local, head.size, 0, head.shift, head.hash, in_fd,
+                           out_fd);
+    if (root != NULL) {
+      result = pvec_clone(&EMPTY_VECTOR);
+      result->size = head.size;
+      result->shift = head.shift;
+      result->root = root;
+    }
+  }
+  SyncRequest done = {.index = 0, .shift = SYNC_DONE};
+  if (write_full(out_fd, &done, sizeof(done)) < 0) {
+    return NULL;
+  }
+  return result;
+}
+
+// Inline helper functions
+
+static inline Node *node_create(void) {
+  Node *new = PVEC_MALLOC(sizeof(Node));
+  return new;
+}
+
+static inline Node *node_clone(const Node* node) {
+  Node *clone = PVEC_MALLOC(sizeof(Node));
+  memcpy(clone, node, sizeof(Node));
+  return clone;
+}
+
+static inline Pvec* pvec_clone(const Pvec *pvec) {
+  Pvec *clone = PVEC_MALLOC(sizeof(Pvec));
+  memcpy(clone, pvec, sizeof(Pvec));
+  return clone;
+}
+
+// node_rehash recomputes the hash of a node from its children. If the node is
+// a leaf (shift is 0), the children are the first count elements. The count is
+// part of the hash, so that a leaf with NULL elements and a leaf with fewer
+// elements hash differently.
+static inline void node_rehash(Node *node, uint32_t shift, uint32_t count) {
+  uint64_t h;
+  if (shift == 0) {
+    h = count;
+    for (uint32_t i = 0; i < count; i++) {
+      h = h * 0x100000001b3ULL + PVEC_HASH_ELT(node->child[i]);
+    }
+  }
+  else {
+    h = 0;
+    for (uint32_t i = 0; i < PVEC_BRANCHING; i++) {
+      uint64_t child_hash = node->child[i] == NULL ? 0 : node->child[i]->hash;
+      h = h * 0x100000001b3ULL + child_hash;
+    }
+  }
+  node->hash = hash_mix(h);
+}
+
+// rehash_path recomputes the hashes of the path of nodes from the root of pvec
+// towards index, bottom up.
+static void rehash_path(Node **path, uint32_t length, const Pvec *pvec,
+                        uint32_t index) {
+  uint32_t leaf_start = index & ~PVEC_MASK;
+  uint32_t count = 0;
+  if (pvec->size > leaf_start) {
+    count = pvec->size - leaf_start;
+    if (count > PVEC_BRANCHING) {
+      count = PVEC_BRANCHING;
+    }
+  }
+  for (uint32_t i = length; i > 0; i--) {
+    node_rehash(path[i - 1], pvec->shift - (i - 1) * PVEC_BITS, count);
+  }
+}
+
+int main() {
+  const Pvec *p = pvec_create();
+  const Pvec *q = pvec_create();
+  for (uintptr_t i = 0; i < 100; i++) {
+    p = pvec_push(p, (void *) (i + 1));
+  }
+  for (uintptr_t i = 0; i < 200; i++) {
+    q = pvec_push(q, (void *) (i + 1));
+  }
+  // p and q are built independently, so they share no nodes, but contain the
+  // same elements after q has been cut down to size.
+  const Pvec *r = pvec_right_slice(q, 100);
+  printf("hash(p) = %016llx\nhash(r) = %016llx\n",
+         (unsigned long long) pvec_hash(p), (unsigned long long) pvec_hash(r));
+  if (pvec_hash(p) != pvec_hash(r) || !pvec_equals(p, r)) {
+    printf("p and r should be equal\n");
+  }
+  const Pvec *s = pvec_update(p, 50, (void *) 0);
+  if (pvec_hash(s) == pvec_hash(p) || pvec_equals(s, p)) {
+    printf("p and s should differ\n");
+  }
+  if (pvec_hash(pvec_update(s, 50, (void *) 51)) != pvec_hash(p)) {
+    printf("Updating s back should give the hash of p\n");
+  }
+
+  // Synchronise a replica which is 5 updates and 10 pushes behind p through a
+  // pair of pipes. The primary runs in a child process.
+  const Pvec *primary = p;
+  for (uintptr_t i = 0; i < 5; i++) {
+    primary = pvec_update(primary, i * 17, (void *) (1000 + i));
+  }
+  for (uintptr_t i = 0; i < 10; i++) {
+    primary = pvec_push(primary, (void *) (2000 + i));
+  }
+  int to_replica[2], to_primary[2];
+  if (pipe(to_replica) < 0 || pipe(to_primary) < 0) {
+    return 1;
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    int64_t sent = pvec_sync_serve(primary, to_primary[0], to_replica[1]);
+    printf("primary sent %lld nodes\n", (long long) sent);
+    exit(sent < 0);
+  }
+  const Pvec *replica = pvec_sync_fetch(p, to_replica[0], to_primary[1]);
+  waitpid(pid, NULL, 0);
+  if (replica == NULL || !pvec_equals(replica, primary)) {
+    printf("replica is not equal to the primary\n");
+  }
+}
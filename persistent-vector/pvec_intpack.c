@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2014 Jean Niklas L'orange. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * This is a persistent vector of integers (stored in the void pointers of the
+ * usual interface) with compressed leaves. Like the byte vector, the leaves are
+ * not tables of pointers, but hold 2**PVEC_LEAF_BITS elements in one of two
+ * encodings:
+ *
+ * - Frame of reference: The smallest element is stored once, and every element
+ *   is stored as its difference from it, using as few bits as the largest
+ *   difference needs.
+ * - Delta: For leaves where the elements never decrease, the first element is
+ *   stored once, and every element as its difference from the one before it.
+ *   Accessing element i has to add up the i differences before it.
+ *
+ * Whichever encoding needs the fewest bits per element is used. Leaves of
+ * small or increasing integers therefore shrink several-fold compared to 8
+ * bytes per element. Elements are decoded on access, and an update only
+ * decodes and re-encodes the single leaf it changes.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "pvec.h"
+#include "pvec_alloc.h"
+
+#ifndef PVEC_LEAF_BITS
+// PVEC_LEAF_BITS is the number of bits used per leaf: Every leaf contains up
+// to 2**PVEC_LEAF_BITS elements. Larger leaves compress better, but updates
+// re-encode more elements. It must be between 1 and 15.
+#define PVEC_LEAF_BITS 6
+#endif
+
+#define PVEC_LEAF_SIZE (1 << PVEC_LEAF_BITS)
+#define PVEC_LEAF_MASK (PVEC_LEAF_SIZE - 1)
+
+#define LEAF_FOR 0
+#define LEAF_DELTA 1
+
+// This is an interior trie node. It is always the branching factor size
+// (unused table entries will be NULL).
+typedef struct Node {
+  struct Node *child[PVEC_BRANCHING];
+} Node;
+
+// This is a leaf. Its size depends on the number of elements and bits per
+// element. It contains no pointers, so leaves are allocated with
+// PVEC_MALLOC_ATOMIC.
+typedef struct Leaf {
+  // The smallest element (LEAF_FOR) or the first element (LEAF_DELTA).
+  uint64_t base;
+  uint8_t encoding;
+  // The number of bits per element, 0 to 64.
+  uint8_t width;
+  // The number of elements in the leaf.
+  uint16_t count;
+  uint64_t packed[];
+} Leaf;
+
+struct _Pvec {
+  // The size of the vector.
+  uint32_t size;
+  // The height of the vector, represented as a shift. Interior nodes have the
+  // shifts PVEC_LEAF_BITS, PVEC_LEAF_BITS + PVEC_BITS, and so on. A shift of 0
+  // means that the root is a leaf.
+  uint32_t shift;
+  // The root of the vector. NULL if the vector is empty.
+  Node *root;
+};
+
+// An empty vector. (Not necessarily the only empty vector!)
+static Pvec EMPTY_VECTOR = {.size = 0, .shift = 0, .root = NULL};
+
+// These are just prototypes -- no need to worry about these.
+static inline Node *node_clone(const Node *node);
+static inline Pvec* pvec_clone(const Pvec *pvec);
+
+// shift_down returns the shift of the children of a node with the given shift.
+static inline uint32_t shift_down(uint32_t shift) {
+  return shift == PVEC_LEAF_BITS ? 0 : shift - PVEC_BITS;
+}
+
+// capacity returns the number of elements a node with the given shift can hold.
+static inline uint64_t capacity(uint32_t shift) {
+  return shift == 0 ? PVEC_LEAF_SIZE : (uint64_t) PVEC_BRANCHING << shift;
+}
+
+// The leaf codec
+
+// bit_width returns the number of bits needed to represent value.
+static inline uint8_t bit_width(uint64_t value) {
+  return value == 0 ? 0 : 64 - __builtin_clzll(value);
+}
+
+// unpack returns the width bit value number i in packed.
+static inline uint64_t unpack(const uint64_t *packed, uint32_t width, uint32_t i) {
+  if (width == 0) {
+    return 0;
+  }
+  uint64_t bit = (uint64_t) i * width;
+  uint32_t word = bit >> 6, offset = bit & 63;
+  uint64_t value = packed[word] >> offset;
+  if (offset + width > 64) {
+    value |= packed[word + 1] << (64 - offset);
+  }
+  return width == 64 ? value : value & ((UINT64_C(1) << width) - 1);
+}
+
+static inline void pack(uint64_t *packed, uint32_t width, uint32_t i,
+                        uint64_t value) {
+  if (width == 0) {
+    return;
+  }
+  uint64_t bit = (uint64_t) i * width;
+  uint32_t word = bit >> 6, offset = bit & 63;
+  packed[word] |= value << offset;
+  if (offset + width > 64) {
+    packed[word + 1] |= value >> (64 - offset);
+  }
+}
+
+// leaf_encode returns a leaf with the count values, in whichever encoding
+// needs the fewest bits per value.
+static Leaf *leaf_encode(const uint64_t *values, uint32_t count) {
+  uint64_t min = values[0], max = values[0], max_delta = 0;
+  int increasing = 1;
+  for (uint32_t i = 1; i < count; i++) {
+    min = values[i] < min ? values[i] : min;
+    max = values[i] > max ? values[i] : max;
+    if (values[i] < values[i - 1]) {
+      increasing = 0;
+    }
+    else if (values[i] - values[i - 1] > max_delta) {
+      max_delta = values[i] - values[i - 1];
+    }
+  }
+  uint8_t encoding = LEAF_FOR;
+  uint8_t width = bit_width(max - min);
+  if (increasing && bit_width(max_delta) < width) {
+    encoding = LEAF_DELTA;
+    width = bit_width(max_delta);
+  }
+  size_t words = ((uint64_t) count * width + 63) / 64;
+  Leaf *leaf = PVEC_MALLOC_ATOMIC(sizeof(Leaf) + words * sizeof(uint64_t));
+  // pack ORs bits into the words, which atomic allocations do not clear.
+  memset(leaf->packed, 0, words * sizeof(uint64_t));
+  leaf->encoding = encoding;
+  leaf->width = width;
+  leaf->count = count;
+  if (encoding == LEAF_FOR) {
+    leaf->base = min;
+    for (uint32_t i = 0; i < count; i++) {
+      pack(leaf->packed, width, i, values[i] - min);
+    }
+  }
+  else {
+    // The first delta is always 0, and is not stored.
+    leaf->base = values[0];
+    for (uint32_t i = 1; i < count; i++) {
+      pack(leaf->packed, width, i - 1, values[i] - values[i - 1]);
+    }
+  }
+  return leaf;
+}
+
+// leaf_decode writes the values in the leaf to values, and returns how many
+// there are. leaf may be NULL, which is an empty leaf.
+static uint32_t leaf_decode(const Leaf *leaf, uint64_t *values) {
+  if (leaf == NULL) {
+    return 0;
+  }
+  uint64_t value = leaf->base;
+  for (uint32_t i = 0; i < leaf->count; i++) {
+    if (leaf->encoding == LEAF_FOR) {
+      values[i] = leaf->base + unpack(leaf->packed, leaf->width, i);
+    }
+    else {
+      if (i > 0) {
+        value += unpack(leaf->packed, leaf->width, i - 1);
+      }
+      values[i] = value;
+    }
+  }
+  return leaf->count;
+}
+
+static inline uint64_t leaf_get(const Leaf *leaf, uint32_t i) {
+  if (leaf->encoding == LEAF_FOR) {
+    return leaf->base + unpack(leaf->packed, leaf->width, i);
+  }
+  uint64_t value = leaf->base;
+  for (uint32_t j = 0; j < i; j++) {
+    value += unpack(leaf->packed, leaf->width, j);
+  }
+  return value;
+}
+
+// leaf_with returns a leaf where element i is value. i may be the element
+// after the last one, in which case the leaf is extended.
+static Leaf *leaf_with(const Leaf *leaf, uint32_t i, uint64_t value) {
+  uint64_t values[PVEC_LEAF_SIZE];
+  uint32_t count = leaf_decode(leaf, values);
+  values[i] = value;
+  return leaf_encode(values, i < count ? count : i + 1);
+}
+
+// leaf_truncate returns a leaf with the first count elements of leaf.
+static Leaf *leaf_truncate(const Leaf *leaf, uint32_t count) {
+  uint64_t values[PVEC_LEAF_SIZE];
+  leaf_decode(leaf, values);
+  return leaf_encode(values, count);
+}
+
+// leaf_for returns the leaf containing index.
+static inline const Leaf *leaf_for(const Pvec *pvec, uint32_t index) {
+  const Node *node = pvec->root;
+  for (uint32_t s = pvec->shift; s > 0; s = shift_down(s)) {
+    node = node->child[(index >> s) & PVEC_MASK];
+  }
+  return (const Leaf *) node;
+}
+
+// pvec_create just returns the empty vector.
+const Pvec* pvec_create() {
+  return &EMPTY_VECTOR;
+}
+
+// pvec_count just returns the size value inside the vector head.
+uint32_t pvec_count(const Pvec *pvec) {
+  return pvec->size;
+}
+
+void* pvec_nth(const Pvec *pvec, uint32_t index) {
+  return (void *) (uintptr_t) leaf_get(leaf_for(pvec, index),
+                                       index & PVEC_LEAF_MASK);
+}
+
+void* pvec_peek(const Pvec *pvec) {
+  return pvec_nth(pvec, pvec_count(pvec) - 1);
+}
+
+const Pvec* pvec_update(const Pvec *restrict pvec, uint32_t index,
+                        const void *restrict elt) {
+  Pvec *clone = pvec_clone(pvec);
+  Node **slot = &clone->root;
+  for (uint32_t s = pvec->shift; s > 0; s = shift_down(s)) {
+    *slot = node_clone(*slot);
+    slot = &(*slot)->child[(index >> s) & PVEC_MASK];
+  }
+  *slot = (Node *) leaf_with((const Leaf *) *slot, index & PVEC_LEAF_MASK,
+                             (uintptr_t) elt);
+  return (const Pvec*) clone;
+}
+
+const Pvec* pvec_push(const Pvec *restrict pvec, const void *restrict elt) {
+  Pvec *clone = pvec_clone(pvec);
+  uint32_t index = pvec->size;
+  clone->size = pvec->size + 1;
+  if (index == capacity(pvec->shift)) {
+    Node *new_root = PVEC_MALLOC(sizeof(Node));
+    new_root->child[0] = pvec->root;
+    clone->root = new_root;
+    clone->shift = pvec->shift == 0 ? PVEC_LEAF_BITS : pvec->shift + PVEC_BITS;
+  }
+  // Interior nodes are cloned or created on the way down, and the leaf is
+  // re-encoded with the new element.
+  Node **slot = &clone->root;
+  for (uint32_t s = clone->shift; s > 0; s = shift_down(s)) {
+    *slot = (*slot == NULL) ? PVEC_MALLOC(sizeof(Node)) : node_clone(*slot);
+    slot = &(*slot)->child[(index >> s) & PVEC_MASK];
+  }
+  *slot = (Node *) leaf_with((const Leaf *) *slot, index & PVEC_LEAF_MASK,
+                             (uintptr_t) elt);
+  return (const Pvec*) clone;
+}
+
+const Pvec* pvec_pop(const Pvec *pvec) {
+  return pvec_right_slice(pvec, pvec->size - 1);
+}
+
+const Pvec* pvec_right_slice(const Pvec *pvec, uint32_t new_size) {
+  if (new_size == 0) {
+    return pvec_create();
+  }
+  Pvec *clone = pvec_clone(pvec);
+  uint32_t index = new_size;
+  clone->size = new_size;
+
+  // We have to cut the tree until the height is minimal
+  while (clone->shift > 0 && new_size <= capacity(shift_down(clone->shift))) {
+    clone->root = clone->root->child[0];
+    clone->shift = shift_down(clone->shift);
+  }
+
+  // The tree being fully dense is a special case, and is short-circuited
+  if (new_size == capacity(clone->shift)) {
+    return clone;
+  }
+
+  Node **slot = &clone->root;
+  for (uint32_t s = clone->shift; s > 0; s = shift_down(s)) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    Node *node = node_clone(*slot);
+    *slot = node;
+    if ((index & (((uint64_t) 1 << s) - 1)) == 0) {
+      memset(&node->child[subindex], 0,
+             (PVEC_BRANCHING - subindex) * sizeof(Node *));
+      return clone;
+    }
+    memset(&node->child[subindex + 1], 0,
+           (PVEC_BRANCHING - (subindex + 1)) * sizeof(Node *));
+    slot = &node->child[subindex];
+  }
+  *slot = (Node *) leaf_truncate((const Leaf *) *slot, index & PVEC_LEAF_MASK);
+  return clone;
+}
+
+// Inline helper functions
+
+static inline Node *node_clone(const Node *node) {
+  Node *clone = PVEC_MALLOC(sizeof(Node));
+  memcpy(clone, node, sizeof(Node));
+  return clone;
+}
+
+static inline Pvec* pvec_clone(const Pvec *pvec) {
+  Pvec *clone = PVEC_MALLOC(sizeof(Pvec));
+  memcpy(clone, pvec, sizeof(Pvec));
+  return clone;
+}
+
+// leaf_bytes returns the number of bytes used by the leaves of the subtree.
+static size_t leaf_bytes(const Node *node, uint32_t shift) {
+  if (node == NULL) {
+    return 0;
+  }
+  if (shift == 0) {
+    const Leaf *leaf = (const Leaf *) node;
+    return sizeof(Leaf) + ((uint64_t) leaf->count * leaf->width + 63) / 64 * 8;
+  }
+  size_t bytes = 0;
+  for (uint32_t i = 0; i < PVEC_BRANCHING; i++) {
+    bytes += leaf_bytes(node->child[i], shift_down(shift));
+  }
+  return bytes;
+}
+
+int main() {
+  // Increasing timestamps, and small integers.
+  const Pvec *times = pvec_create();
+  const Pvec *small = pvec_create();
+  uint64_t t = 1400000000;
+  for (uint32_t i = 0; i < 100000; i++) {
+    t += rand() % 100;
+    times = pvec_push(times, (void *) (uintptr_t) t);
+    small = pvec_push(small, (void *) (uintptr_t) (rand() % 1000));
+  }
+  const Pvec *updated = pvec_update(times, 5000, (void *) 42);
+  if ((uintptr_t) pvec_nth(updated, 5000) != 42 ||
+      pvec_nth(times, 5000) == (void *) 42) {
+    printf("Update not ok\n");
+  }
+  printf("increasing: %zu bytes in leaves (%u as pointers)\n",
+         leaf_bytes(times->root, times->shift), 8 * pvec_count(times));
+  printf("small:      %zu bytes in leaves (%u as pointers)\n",
+         leaf_bytes(small->root, small->shift), 8 * pvec_count(small));
+}
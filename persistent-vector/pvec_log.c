@@ -0,0 +1,717 @@
+/*
+ * Copyright (c) 2014 Jean Niklas L'orange. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * This is the vanilla implementation of a persistent vector which can be made
+ * durable by appending it to a log file. An update only creates O(log n) new
+ * nodes, and only those are written: Every node remembers where it is in the
+ * log, so appending a version writes the nodes which are not in the log yet,
+ * children before parents, followed by a header record with the size, height
+ * and root of the version.
+ *
+ * The header of a version also contains a checksum of the records written with
+ * it. When the log is opened, it is scanned for the last header with a valid
+ * checksum, and anything after it (a version that was not completely written)
+ * is cut off. Writes are only forced to disk every PVEC_LOG_SYNC_EVERY
+ * versions, or when pvec_log_sync is called, so a crash may lose the versions
+ * appended since then, but never corrupts the log.
+ *
+ * Opening a log does not read the vector into memory. Instead, a child (or
+ * root) pointer may be a reference to a node in the log, tagged by setting its
+ * lowest bit. Such nodes are read when an operation walks through them, and
+ * kept in an LRU cache of PVEC_LOG_CACHE_NODES nodes. Nodes are never modified,
+ * so nodes evicted from the cache can be read again at any time, and vectors
+ * far larger than memory only keep the recently used paths resident. Nodes
+ * created since the log was opened stay in memory as long as a vector uses
+ * them.
+ *
+ * There is one log per process. Elements are written by value, so they should
+ * not be pointers into this process.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define LOG_PVEC
+#include "pvec.h"
+#include "pvec_alloc.h"
+
+// PVEC_LOG_SYNC_EVERY is the number of versions appended between each fsync.
+#ifndef PVEC_LOG_SYNC_EVERY
+#define PVEC_LOG_SYNC_EVERY 32
+#endif
+
+// PVEC_LOG_CACHE_NODES is the number of nodes read from the log kept in memory.
+#ifndef PVEC_LOG_CACHE_NODES
+#define PVEC_LOG_CACHE_NODES (1 << 16)
+#endif
+
+// This is a trie node. It is always the branching factor size (unused table
+// entries will be NULL). In interior nodes, children may be log references.
+typedef struct Node {
+  // The offset of this node in the log, 0 if it has not been written yet.
+  uint64_t log_offset;
+  struct Node *child[PVEC_BRANCHING];
+} Node;
+
+// Nodes are aligned, so the lowest bit of a node pointer is always 0. A log
+// reference is the offset of the node, shifted left once, with that bit set.
+#define IS_LOG_REF(ref) (((uintptr_t) (ref)) & 1)
+#define LOG_REF(offset) ((Node *) (uintptr_t) (((offset) << 1) | 1))
+#define LOG_REF_OFFSET(ref) (((uintptr_t) (ref)) >> 1)
+
+struct _Pvec {
+  // The size of the vector.
+  uint32_t size;
+  // The height of the vector, represented as a shift.
+  uint32_t shift;
+  // The root of the vector, which may be a log reference.
+  Node* root;
+};
+
+static Node EMPTY_NODE = {.log_offset = 0, .child = {0}};
+
+// An empty vector. (Not necessarily the only empty vector!)
+static Pvec EMPTY_VECTOR = {.size = 0, .shift = 0, .root = &EMPTY_NODE};
+
+// The log starts with a file header, followed by records. Every record starts
+// with its kind.
+#define LOG_MAGIC "PVECLOG1"
+#define LOG_NODE 1
+#define LOG_HEAD 2
+
+typedef struct {
+  char magic[8];
+  uint32_t bits;
+  uint32_t reserved;
+} LogFileHeader;
+
+// Slots are log offsets of children in interior nodes, and elements in leaves.
+typedef struct {
+  uint32_t kind;
+  uint32_t shift;
+  uint64_t slot[PVEC_BRANCHING];
+} LogNode;
+
+typedef struct {
+  uint32_t kind;
+  uint32_t shift;
+  uint32_t size;
+  uint32_t reserved;
+  uint64_t root;
+  // The checksum of the node records since the last header, and the fields
+  // above.
+  uint64_t checksum;
+} LogHead;
+
+typedef struct {
+  int fd;
+  // The end of the log.
+  uint64_t end;
+  // The number of versions appended since the last fsync.
+  uint32_t unsynced;
+} Log;
+
+static Log log_file = {.fd = -1, .end = 0, .unsynced = 0};
+
+// The node cache is a hash table from log offsets to entries, which are also in
+// a list from the most to the least recently used. Entries are referred to by
+// their index in entries, plus one, so that 0 can be used as NULL.
+typedef struct {
+  uint64_t offset;
+  Node *node;
+  uint32_t bucket_next;
+  uint32_t lru_prev, lru_next;
+} CacheEntry;
+
+typedef struct {
+  CacheEntry *entries;
+  uint32_t count;
+  uint32_t *buckets;
+  uint32_t bucket_mask;
+  uint32_t lru_head, lru_tail;
+} Cache;
+
+static Cache cache = {.entries = NULL};
+
+// These are just prototypes -- no need to worry about these.
+static Node *node_at(Node *ref);
+static inline Node *node_create(void);
+static inline Node *node_clone(Node *ref);
+static inline Pvec* pvec_clone(const Pvec *pvec);
+
+// pvec_create just returns the empty vector.
+const Pvec* pvec_create() {
+  return &EMPTY_VECTOR;
+}
+
+// pvec_count just returns the size value inside the vector head.
+uint32_t pvec_count(const Pvec *pvec) {
+  return pvec->size;
+}
+
+void* pvec_nth(const Pvec *pvec, uint32_t index) {
+  Node *node = node_at(pvec->root);
+  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    node = node_at(node->child[subindex]);
+  }
+  return (void *) node->child[index & PVEC_MASK];
+}
+
+void* pvec_peek(const Pvec *pvec) {
+  return pvec_nth(pvec, pvec_count(pvec) - 1);
+}
+
+const Pvec* pvec_update(const Pvec *restrict pvec, uint32_t index,
+                        const void *restrict elt) {
+  Pvec *clone = pvec_clone(pvec);
+  Node *node = node_clone(pvec->root);
+  clone->root = node;
+  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    node->child[subindex] = node_clone(node->child[subindex]);
+    node = node->child[subindex];
+  }
+  node->child[index & PVEC_MASK] = (Node *) elt;
+  return (const Pvec*) clone;
+}
+
+const Pvec* pvec_push(const Pvec *restrict pvec, const void *restrict elt) {
+  Pvec *clone = pvec_clone(pvec);
+  uint32_t index = pvec_count(pvec);
+  clone->size = pvec->size + 1;
+  // this is the d_full(P) check for bit vectors
+  if (pvec_count(pvec) == ((uint64_t) PVEC_BRANCHING << pvec->shift)) {
+    Node *new_root = node_create();
+    new_root->child[0] = pvec->root;
+    clone->root = new_root;
+    clone->shift = pvec->shift + PVEC_BITS;
+  }
+  else {
+    clone->root = node_clone(pvec->root);
+  }
+  Node *node = clone->root;
+  for (uint32_t s = clone->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    if (node->child[subindex] == NULL) { // the create part of clone-or-create
+      node->child[subindex] = node_create();
+    }
+    else { // the clone part of clone-or-create
+      node->child[subindex] = node_clone(node->child[subindex]);
+    }
+    node = node->child[subindex];
+  }
+  node->child[index & PVEC_MASK] = (Node *) elt;
+  return (const Pvec*) clone;
+}
+
+const Pvec* pvec_pop(const Pvec *pvec) {
+  Pvec *clone = pvec_clone(pvec);
+  uint32_t index = pvec_count(pvec) - 1;
+  clone->size = pvec_count(pvec) - 1;
+  if (pvec_count(clone) == (1u << pvec->shift) && pvec->shift > 0) {
+    clone->shift = pvec->shift - PVEC_BITS;
+    clone->root = node_at(pvec->root)->child[0];
+    return clone;
+  }
+  Node *node = node_clone(pvec->root);
+  clone->root = node;
+  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    if ((index & ((1u << s) - 1)) == 0) {
+      node->child[subindex] = NULL;
+      return clone;
+    }
+    node->child[subindex] = node_clone(node->child[subindex]);
+    node = node->child[subindex];
+  }
+  node->child[index & PVEC_MASK] = NULL;
+  return clone;
+}
+
+const Pvec* pvec_right_slice(const Pvec *pvec, uint32_t new_size) {
+  Pvec *clone = pvec_clone(pvec);
+  uint32_t index = new_size;
+  clone->size = new_size;
+
+  // We have to cut the tree until the height is minimal
+  while (pvec_count(clone) <= (1u << clone->shift) && clone->shift > 0) {
+    clone->shift = clone->shift - PVEC_BITS;
+    clone->root = node_at(clone->root)->child[0];
+  }
+
+  // The tree being fully dense is a special case, and is short-circuited
+  if (pvec_count(clone) == ((uint64_t) PVEC_BRANCHING << clone->shift)) {
+    return clone;
+  }
+
+  Node *node = node_clone(clone->root);
+  clone->root = node;
+  for (uint32_t s = clone->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    if ((index & ((1u << s) - 1)) == 0) {
+      memset(&node->child[subindex], 0,
+             (PVEC_BRANCHING - subindex) * sizeof(Node *));
+      return clone;
+    }
+    node->child[subindex] = node_clone(node->child[subindex]);
+    memset(&node->child[subindex + 1], 0,
+           (PVEC_BRANCHING - (subindex + 1)) * sizeof(Node *));
+    node = node->child[subindex];
+  }
+  uint32_t subindex = index & PVEC_MASK;
+  memset(&node->child[subindex], 0,
+         (PVEC_BRANCHING - subindex) * sizeof(Node *));
+  return clone;
+}
+
+// Log functions
+
+static int write_full(int fd, const void *buf, size_t len) {
+  const uint8_t *ptr = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, ptr, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    ptr += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// pread_full returns -1 on errors and when the file ends before len bytes are
+// read.
+static int pread_full(int fd, void *buf, size_t len, uint64_t offset) {
+  uint8_t *ptr = buf;
+  while (len > 0) {
+    ssize_t n = pread(fd, ptr, len, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    ptr += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+// FNV-1a, continued from hash.
+static uint64_t checksum(uint64_t hash, const void *buf, size_t len) {
+  const uint8_t *ptr = buf;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ ptr[i]) * 0x100000001b3;
+  }
+  return hash;
+}
+
+#define CHECKSUM_INIT 0xcbf29ce484222325
+
+// The records of a version are gathered in a buffer, so they are written with
+// one system call. The nodes given offsets are kept, in case the write fails.
+typedef struct {
+  uint8_t *bytes;
+  size_t len, capacity;
+  Node **written;
+  size_t written_len, written_capacity;
+} Batch;
+
+static void batch_add(Batch *batch, const void *record, size_t len) {
+  if (batch->len + len > batch->capacity) {
+    batch->capacity = 2 * (batch->len + len);
+    batch->bytes = realloc(batch->bytes, batch->capacity);
+  }
+  memcpy(batch->bytes + batch->len, record, len);
+  batch->len += len;
+}
+
+// log_node adds the nodes of the subtree not in the log yet to the batch,
+// children first, so they can refer to their children by offset. It returns the
+// offset of the subtree, or 0 if ref is NULL.
+static uint64_t log_node(Batch *batch, Node *ref, uint32_t shift) {
+  if (ref == NULL) {
+    return 0;
+  }
+  if (IS_LOG_REF(ref)) {
+    return LOG_REF_OFFSET(ref);
+  }
+  if (ref->log_offset != 0) {
+    return ref->log_offset;
+  }
+  LogNode record = {.kind = LOG_NODE, .shift = shift};
+  for (uint32_t i = 0; i < PVEC_BRANCHING; i++) {
+    if (shift > 0) {
+      record.slot[i] = log_node(batch, ref->child[i], shift - PVEC_BITS);
+    }
+    else {
+      record.slot[i] = (uintptr_t) ref->child[i];
+    }
+  }
+  ref->log_offset = log_file.end + batch->len;
+  batch_add(batch, &record, sizeof(record));
+  if (batch->written_len == batch->written_capacity) {
+    batch->written_capacity = batch->written_capacity == 0 ? 16 : 2 * batch->written_capacity;
+    batch->written = realloc(batch->written, batch->written_capacity * sizeof(Node *));
+  }
+  batch->written[batch->written_len++] = ref;
+  return ref->log_offset;
+}
+
+int pvec_log_append(const Pvec *pvec) {
+  Batch batch = {0};
+  uint64_t root = log_node(&batch, pvec->root, pvec->shift);
+  LogHead head = {.kind = LOG_HEAD, .shift = pvec->shift, .size = pvec->size,
+                  .root = root};
+  uint64_t hash = checksum(CHECKSUM_INIT, batch.bytes, batch.len);
+  head.checksum = checksum(hash, &head, offsetof(LogHead, checksum));
+  batch_add(&batch, &head, sizeof(head));
+
+  int result = 0;
+  if (write_full(log_file.fd, batch.bytes, batch.len) < 0) {
+    // The nodes are not in the log after all. Cut off whatever made it, so the
+    // next append starts at the same place.
+    for (size_t i = 0; i < batch.written_len; i++) {
+      batch.written[i]->log_offset = 0;
+    }
+    if (ftruncate(log_file.fd, log_file.end) < 0 ||
+        lseek(log_file.fd, log_file.end, SEEK_SET) < 0) {
+      // We do not know where we are anymore.
+      close(log_file.fd);
+      log_file.fd = -1;
+    }
+    result = -1;
+  }
+  else {
+    log_file.end += batch.len;
+    if (++log_file.unsynced >= PVEC_LOG_SYNC_EVERY) {
+      result = pvec_log_sync();
+    }
+  }
+  free(batch.bytes);
+  free(batch.written);
+  return result;
+}
+
+int pvec_log_sync(void) {
+  if (log_file.unsynced == 0) {
+    return 0;
+  }
+  if (fsync(log_file.fd) < 0) {
+    return -1;
+  }
+  log_file.unsynced = 0;
+  return 0;
+}
+
+// log_scan finds the end of the last valid header in the log, which is size
+// bytes long. It stores that header in last and its end in end, or the end of
+// the file header if there are no valid headers. Records cut short by the end
+// of the file or failing their checksum end the scan. It returns -1 on read
+// errors, and 0 otherwise.
+static int log_scan(int fd, uint64_t size, LogHead *last, uint64_t *end) {
+  uint64_t offset = sizeof(LogFileHeader);
+  uint64_t hash = CHECKSUM_INIT;
+  *end = offset;
+  for (;;) {
+    uint32_t kind;
+    if (offset + sizeof(kind) > size) {
+      return 0;
+    }
+    if (pread_full(fd, &kind, sizeof(kind), offset) < 0) {
+      return -1;
+    }
+    if (kind == LOG_NODE) {
+      LogNode record;
+      if (offset + sizeof(record) > size) {
+        return 0;
+      }
+      if (pread_full(fd, &record, sizeof(record), offset) < 0) {
+        return -1;
+      }
+      hash = checksum(hash, &record, sizeof(record));
+      offset += sizeof(record);
+    }
+    else if (kind == LOG_HEAD) {
+      LogHead head;
+      if (offset + sizeof(head) > size) {
+        return 0;
+      }
+      if (pread_full(fd, &head, sizeof(head), offset) < 0) {
+        return -1;
+      }
+      if (checksum(hash, &head, offsetof(LogHead, checksum)) != head.checksum) {
+        return 0;
+      }
+      *last = head;
+      offset += sizeof(head);
+      *end = offset;
+      hash = CHECKSUM_INIT;
+    }
+    else {
+      return 0;
+    }
+  }
+}
+
+// The node cache
+
+static void cache_clear(void) {
+  if (cache.entries == NULL) {
+    cache.entries = PVEC_MALLOC(PVEC_LOG_CACHE_NODES * sizeof(CacheEntry));
+    uint32_t buckets = 1;
+    while (buckets < 2 * PVEC_LOG_CACHE_NODES) {
+      buckets *= 2;
+    }
+    cache.buckets = PVEC_MALLOC_ATOMIC(buckets * sizeof(uint32_t));
+    cache.bucket_mask = buckets - 1;
+  }
+  // The nodes in the entries are garbage once they cannot be found anymore.
+  memset(cache.entries, 0, cache.count * sizeof(CacheEntry));
+  memset(cache.buckets, 0, (cache.bucket_mask + 1) * sizeof(uint32_t));
+  cache.count = 0;
+  cache.lru_head = cache.lru_tail = 0;
+}
+
+static inline uint32_t *cache_bucket(uint64_t offset) {
+  return &cache.buckets[(uint32_t) ((offset * 0x9e3779b97f4a7c15) >> 32)
+                        & cache.bucket_mask];
+}
+
+static void lru_unlink(uint32_t e) {
+  CacheEntry *entry = &cache.entries[e - 1];
+  if (entry->lru_prev != 0) {
+    cache.entries[entry->lru_prev - 1].lru_next = entry->lru_next;
+  }
+  else {
+    cache.lru_head = entry->lru_next;
+  }
+  if (entry->lru_next != 0) {
+    cache.entries[entry->lru_next - 1].lru_prev = entry->lru_prev;
+  }
+  else {
+    cache.lru_tail = entry->lru_prev;
+  }
+}
+
+static void lru_push_front(uint32_t e) {
+  CacheEntry *entry = &cache.entries[e - 1];
+  entry->lru_prev = 0;
+  entry->lru_next = cache.lru_head;
+  if (cache.lru_head != 0) {
+    cache.entries[cache.lru_head - 1].lru_prev = e;
+  }
+  else {
+    cache.lru_tail = e;
+  }
+  cache.lru_head = e;
+}
+
+// log_read reads the node at the given offset. Operations on vectors cannot
+// fail, so we give up if the log cannot be read.
+static Node *log_read(uint64_t offset) {
+  LogNode record;
+  if (pread_full(log_file.fd, &record, sizeof(record), offset) < 0 ||
+      record.kind != LOG_NODE) {
+    fprintf(stderr, "pvec: cannot read the node at %llu in the log\n",
+            (unsigned long long) offset);
+    abort();
+  }
+  Node *node = node_create();
+  node->log_offset = offset;
+  for (uint32_t i = 0; i < PVEC_BRANCHING; i++) {
+    if (record.shift == 0) {
+      node->child[i] = (Node *) (uintptr_t) record.slot[i];
+    }
+    else if (record.slot[i] != 0) {
+      node->child[i] = LOG_REF(record.slot[i]);
+    }
+  }
+  return node;
+}
+
+// node_at returns the node ref refers to, reading it from the log if it is not
+// in the cache.
+static Node *node_at(Node *ref) {
+  if (!IS_LOG_REF(ref)) {
+    return ref;
+  }
+  uint64_t offset = LOG_REF_OFFSET(ref);
+  uint32_t *bucket = cache_bucket(offset);
+  for (uint32_t e = *bucket; e != 0; e = cache.entries[e - 1].bucket_next) {
+    if (cache.entries[e - 1].offset == offset) {
+      if (cache.lru_head != e) {
+        lru_unlink(e);
+        lru_push_front(e);
+      }
+      return cache.entries[e - 1].node;
+    }
+  }
+
+  uint32_t e;
+  if (cache.count < PVEC_LOG_CACHE_NODES) {
+    e = ++cache.count;
+  }
+  else {
+    // Evict the least recently used node. Anyone still using it keeps it alive,
+    // and it is read again if it is needed later.
+    e = cache.lru_tail;
+    lru_unlink(e);
+    uint32_t *link = cache_bucket(cache.entries[e - 1].offset);
+    while (*link != e) {
+      link = &cache.entries[*link - 1].bucket_next;
+    }
+    *link = cache.entries[e - 1].bucket_next;
+  }
+  CacheEntry *entry = &cache.entries[e - 1];
+  entry->offset = offset;
+  entry->node = log_read(offset);
+  entry->bucket_next = *bucket;
+  *bucket = e;
+  lru_push_front(e);
+  return entry->node;
+}
+
+const Pvec* pvec_log_open(const char *path) {
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    return NULL;
+  }
+  LogFileHeader header;
+  LogFileHeader expected = {.magic = LOG_MAGIC, .bits = PVEC_BITS};
+  const Pvec *pvec = pvec_create();
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+  if ((uint64_t) st.st_size < sizeof(header)) {
+    // A new log (or one where not even the file header was written).
+    if (ftruncate(fd, 0) < 0 || write_full(fd, &expected, sizeof(expected)) < 0 ||
+        fsync(fd) < 0) {
+      close(fd);
+      return NULL;
+    }
+    log_file.end = sizeof(expected);
+  }
+  else {
+    // Read errors leave the file untouched: Only a tail which is cut short or
+    // fails its checksum is truncated.
+    LogHead last = {.size = 0};
+    uint64_t end;
+    if (pread_full(fd, &header, sizeof(header), 0) < 0 ||
+        memcmp(&header, &expected, sizeof(header)) != 0 ||
+        log_scan(fd, st.st_size, &last, &end) < 0) {
+      close(fd);
+      return NULL;
+    }
+    if ((end < (uint64_t) st.st_size && ftruncate(fd, end) < 0) ||
+        lseek(fd, end, SEEK_SET) < 0) {
+      close(fd);
+      return NULL;
+    }
+    log_file.end = end;
+    if (last.size > 0) {
+      // Nothing is read until it is used.
+      Pvec *loaded = PVEC_MALLOC(sizeof(Pvec));
+      loaded->size = last.size;
+      loaded->shift = last.shift;
+      loaded->root = LOG_REF(last.root);
+      pvec = loaded;
+    }
+  }
+  // Nodes of a previous log would claim to be in this one.
+  EMPTY_NODE.log_offset = 0;
+  cache_clear();
+  log_file.fd = fd;
+  log_file.unsynced = 0;
+  return pvec;
+}
+
+int pvec_log_close(void) {
+  int result = pvec_log_sync();
+  if (close(log_file.fd) < 0) {
+    result = -1;
+  }
+  log_file.fd = -1;
+  return result;
+}
+
+// Inline helper functions
+
+static inline Node *node_create(void) {
+  Node *new = PVEC_MALLOC(sizeof(Node));
+  return new;
+}
+
+// node_clone copies the node ref refers to. Clones are new nodes, so they are
+// not in the log.
+static inline Node *node_clone(Node *ref) {
+  Node *clone = PVEC_MALLOC(sizeof(Node));
+  memcpy(clone, node_at(ref), sizeof(Node));
+  clone->log_offset = 0;
+  return clone;
+}
+
+static inline Pvec* pvec_clone(const Pvec *pvec) {
+  Pvec *clone = PVEC_MALLOC(sizeof(Pvec));
+  memcpy(clone, pvec, sizeof(Pvec));
+  return clone;
+}
+
+int main() {
+  const char *path = "pvec-example.log";
+  unlink(path);
+  const Pvec *p = pvec_log_open(path);
+  for (uintptr_t i = 0; i < 1000; i++) {
+    p = pvec_push(p, (void *) (i + 1));
+    pvec_log_append(p);
+  }
+  p = pvec_update(p, 500, (void *) 0);
+  pvec_log_append(p);
+  pvec_log_close();
+
+  // Reopening the log gives us the last version appended.
+  const Pvec *q = pvec_log_open(path);
+  for (uint32_t i = 0; i < 1000; i++) {
+    if ((uintptr_t) pvec_nth(q, i) != (i == 500 ? 0 : i + 1)) {
+      printf("For %u, not ok\n", i);
+    }
+  }
+  printf("1001 versions of up to %u elements take %ld bytes\n", pvec_count(q),
+         (long) lseek(log_file.fd, 0, SEEK_END));
+  pvec_log_close();
+  unlink(path);
+}
@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2014 Jean Niklas L'orange. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * This is the vanilla implementation of a persistent vector where every node
+ * caches an aggregate of the elements in its subtree, for instance their sum,
+ * minimum or maximum. Aggregates are computed with a monoid given when the
+ * vector is created: A function measuring a single element, an associative
+ * function combining two aggregates, and the identity of that function.
+ *
+ * As with the hashed vector, only the nodes on the path an operation copies
+ * change, so only their aggregates are recomputed, bottom up. The aggregate of
+ * any range of a version is then combined from O(log n) cached aggregates,
+ * plus the elements at the two ends. The same aggregates let a search for the
+ * first prefix satisfying a predicate, such as a running total exceeding a
+ * threshold, skip whole subtrees.
+ *
+ * Only elements inside the vector are measured, so slots past the end do not
+ * have to measure as the identity. Aggregates are combined from left to right,
+ * so the monoid does not have to be commutative.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#define MONOID_PVEC
+#include "pvec.h"
+#include "pvec_alloc.h"
+
+// This is a trie node. It is always the branching factor size (unused table
+// entries will be NULL).
+typedef struct Node {
+  // The aggregate of the elements in the subtree.
+  PvecAgg agg;
+  struct Node *child[PVEC_BRANCHING];
+} Node;
+
+struct _Pvec {
+  // The size of the vector.
+  uint32_t size;
+  // The height of the vector, represented as a shift.
+  uint32_t shift;
+  // The root of the vector.
+  Node* root;
+  // The monoid the aggregates are computed with.
+  const PvecMonoid *monoid;
+};
+
+static Node EMPTY_NODE = {.child = {0}};
+
+// The default monoid sums the elements as integers.
+static PvecAgg sum_measure(const void *elt) {
+  return (PvecAgg) (intptr_t) elt;
+}
+
+static PvecAgg sum_combine(PvecAgg a, PvecAgg b) {
+  return a + b;
+}
+
+static const PvecMonoid SUM_MONOID = {.identity = 0, .measure = sum_measure,
+                                      .combine = sum_combine};
+
+// An empty vector. (Not necessarily the only empty vector!)
+static Pvec EMPTY_VECTOR = {.size = 0, .shift = 0, .root = &EMPTY_NODE,
+                            .monoid = &SUM_MONOID};
+
+// These are just prototypes -- no need to worry about these.
+static inline Node *node_create(void);
+static inline Node *node_clone(const Node* node);
+static inline Pvec* pvec_clone(const Pvec *pvec);
+static void measure_path(Node **path, uint32_t length, const Pvec *pvec,
+                         uint32_t index);
+
+// pvec_create returns the empty vector, which sums its elements.
+const Pvec* pvec_create() {
+  return &EMPTY_VECTOR;
+}
+
+const Pvec* pvec_create_monoid(const PvecMonoid *monoid) {
+  Pvec *pvec = pvec_clone(&EMPTY_VECTOR);
+  pvec->monoid = monoid;
+  return pvec;
+}
+
+// pvec_count just returns the size value inside the vector head.
+uint32_t pvec_count(const Pvec *pvec) {
+  return pvec->size;
+}
+
+void* pvec_nth(const Pvec *pvec, uint32_t index) {
+  Node *node = pvec->root;
+  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    node = node->child[subindex];
+  }
+  return (void *) node->child[index & PVEC_MASK];
+}
+
+void* pvec_peek(const Pvec *pvec) {
+  return pvec_nth(pvec, pvec_count(pvec) - 1);
+}
+
+// The functions below are the vanilla ones, except that they remember the path
+// of nodes they have copied, so that its aggregates can be recomputed at the
+// end.
+
+const Pvec* pvec_update(const Pvec *restrict pvec, uint32_t index,
+                        const void *restrict elt) {
+  Node *path[PVEC_MAX_HEIGHT + 1];
+  uint32_t length = 0;
+  Pvec *clone = pvec_clone(pvec);
+  Node *node = node_clone(pvec->root);
+  clone->root = node;
+  path[length++] = node;
+  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    node->child[subindex] = node_clone(node->child[subindex]);
+    node = node->child[subindex];
+    path[length++] = node;
+  }
+  node->child[index & PVEC_MASK] = (Node *) elt;
+  measure_path(path, length, clone, index);
+  return (const Pvec*) clone;
+}
+
+const Pvec* pvec_push(const Pvec *restrict pvec, const void *restrict elt) {
+  Node *path[PVEC_MAX_HEIGHT + 1];
+  uint32_t length = 0;
+  Pvec *clone = pvec_clone(pvec);
+  uint32_t index = pvec_count(pvec);
+  clone->size = pvec->size + 1;
+  // this is the d_full(P) check for bit vectors
+  if (pvec_count(pvec) == ((uint64_t) PVEC_BRANCHING << pvec->shift)) {
+    Node *new_root = node_create();
+    new_root->child[0] = pvec->root;
+    clone->root = new_root;
+    clone->shift = pvec->shift + PVEC_BITS;
+  }
+  else {
+    clone->root = node_clone(pvec->root);
+  }
+  Node *node = clone->root;
+  path[length++] = node;
+  for (uint32_t s = clone->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    if (node->child[subindex] == NULL) { // the create part of clone-or-create
+      node->child[subindex] = node_create();
+    }
+    else { // the clone part of clone-or-create
+      node->child[subindex] = node_clone(node->child[subindex]);
+    }
+    node = node->child[subindex];
+    path[length++] = node;
+  }
+  node->child[index & PVEC_MASK] = (Node *) elt;
+  measure_path(path, length, clone, index);
+  return (const Pvec*) clone;
+}
+
+const Pvec* pvec_pop(const Pvec *pvec) {
+  Node *path[PVEC_MAX_HEIGHT + 1];
+  uint32_t length = 0;
+  Pvec *clone = pvec_clone(pvec);
+  uint32_t index = pvec_count(pvec) - 1;
+  clone->size = pvec_count(pvec) - 1;
+  if (pvec_count(clone) == (1u << pvec->shift) && pvec->shift > 0) {
+    clone->shift = pvec->shift - PVEC_BITS;
+    clone->root = pvec->root->child[0];
+    return clone;
+  }
+  Node *node = node_clone(pvec->root);
+  clone->root = node;
+  path[length++] = node;
+  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    if ((index & ((1u << s) - 1)) == 0) {
+      // The last element is the only element in this subtree.
+      node->child[subindex] = NULL;
+      measure_path(path, length, clone, index);
+      return clone;
+    }
+    node->child[subindex] = node_clone(node->child[subindex]);
+    node = node->child[subindex];
+    path[length++] = node;
+  }
+  node->child[index & PVEC_MASK] = NULL;
+  measure_path(path, length, clone, index);
+  return clone;
+}
+
+const Pvec* pvec_right_slice(const Pvec *pvec, uint32_t new_size) {
+  Node *path[PVEC_MAX_HEIGHT + 1];
+  uint32_t length = 0;
+  Pvec *clone = pvec_clone(pvec);
+  uint32_t index = new_size;
+  clone->size = new_size;
+
+  // We have to cut the tree until the height is minimal
+  while (pvec_count(clone) <= (1u << clone->shift) && clone->shift > 0) {
+    clone->shift = clone->shift - PVEC_BITS;
+    clone->root = clone->root->child[0];
+  }
+
+  // The tree being fully dense is a special case, and is short-circuited
+  if (pvec_count(clone) == ((uint64_t) PVEC_BRANCHING << clone->shift)) {
+    return clone;
+  }
+
+  Node *node = node_clone(clone->root);
+  clone->root = node;
+  path[length++] = node;
+  for (uint32_t s = clone->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    if ((index & ((1u << s) - 1)) == 0) {
+      memset(&node->child[subindex], 0,
+             (PVEC_BRANCHING - subindex) * sizeof(Node *));
+      measure_path(path, length, clone, index);
+      return clone;
+    }
+    node->child[subindex] = node_clone(node->child[subindex]);
+    memset(&node->child[subindex + 1], 0,
+           (PVEC_BRANCHING - (subindex + 1)) * sizeof(Node *));
+    node = node->child[subindex];
+    path[length++] = node;
+  }
+  uint32_t subindex = index & PVEC_MASK;
+  memset(&node->child[subindex], 0,
+         (PVEC_BRANCHING - subindex) * sizeof(Node *));
+  measure_path(path, length, clone, index);
+  return clone;
+}
+
+// aggregate_rec returns the aggregate of the elements in [from, to) of the
+// subtree, where the subtree contains size elements. Ranges covering a whole
+// subtree use its cached aggregate.
+static PvecAgg aggregate_rec(const PvecMonoid *monoid, const Node *node,
+                             uint32_t shift, uint64_t size, uint64_t from,
+                             uint64_t to) {
+  if (from == 0 && to == size) {
+    return node->agg;
+  }
+  PvecAgg agg = monoid->identity;
+  if (shift == 0) {
+    for (uint64_t i = from; i < to; i++) {
+      agg = monoid->combine(agg, monoid->measure(node->child[i]));
+    }
+    return agg;
+  }
+  uint64_t child_size = (uint64_t) 1 << shift;
+  for (uint64_t i = from / child_size; i * child_size < to; i++) {
+    uint64_t start = i * child_size;
+    uint64_t end = start + child_size < size ? start + child_size : size;
+    uint64_t child_from = from > start ? from - start : 0;
+    uint64_t child_to = (to < end ? to : end) - start;
+    agg = monoid->combine(agg, aggregate_rec(monoid, node->child[i],
+                                             shift - PVEC_BITS, end - start,
+                                             child_from, child_to));
+  }
+  return agg;
+}
+
+PvecAgg pvec_aggregate(const Pvec *pvec, uint32_t from, uint32_t to) {
+  if (from >= to) {
+    return pvec->monoid->identity;
+  }
+  return aggregate_rec(pvec->monoid, pvec->root, pvec->shift, pvec->size, from,
+                       to);
+}
+
+// pvec_search_prefix walks down from the root, skipping over every child where
+// pred still fails after combining in its aggregate. The search ends in the
+// child where it first holds, and finally at the element where it does.
+uint32_t pvec_search_prefix(const Pvec *pvec,
+                            int (*pred)(PvecAgg agg, void *ctx), void *ctx) {
+  const PvecMonoid *monoid = pvec->monoid;
+  if (pvec->size == 0 || !pred(pvec->root->agg, ctx)) {
+    return pvec->size;
+  }
+  PvecAgg agg = monoid->identity;
+  Node *node = pvec->root;
+  uint32_t index = 0;
+  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = 0;
+    // The last child is taken without checking, pred holds somewhere in it.
+    while (subindex + 1 < PVEC_BRANCHING && node->child[subindex + 1] != NULL) {
+      PvecAgg next = monoid->combine(agg, node->child[subindex]->agg);
+      if (pred(next, ctx)) {
+        break;
+      }
+      agg = next;
+      subindex++;
+    }
+    index |= subindex << s;
+    node = node->child[subindex];
+  }
+  uint32_t count = pvec->size - index;
+  if (count > PVEC_BRANCHING) {
+    count = PVEC_BRANCHING;
+  }
+  for (uint32_t i = 0; i < count - 1; i++) {
+    agg = monoid->combine(agg, monoid->measure(node->child[i]));
+    if (pred(agg, ctx)) {
+      return index | i;
+    }
+  }
+  return index | (count - 1);
+}
+
+// Inline helper functions
+
+static inline Node *node_create(void) {
+  Node *new = PVEC_MALLOC(sizeof(Node));
+  return new;
+}
+
+static inline Node *node_clone(const Node* node) {
+  Node *clone = PVEC_MALLOC(sizeof(Node));
+  memcpy(clone, node, sizeof(Node));
+  return clone;
+}
+
+static inline Pvec* pvec_clone(const Pvec *pvec) {
+  Pvec *clone = PVEC_MALLOC(sizeof(Pvec));
+  memcpy(clone, pvec, sizeof(Pvec));
+  return clone;
+}
+
+// node_measure recomputes the aggregate of a node from its children. Leaves only
+// measure their first count elements, the rest are outside the vector.
+static inline void node_measure(const PvecMonoid *monoid, Node *node,
+                                uint32_t shift, uint32_t count) {
+  PvecAgg agg = monoid->identity;
+  if (shift == 0) {
+    for (uint32_t i = 0; i < count; i++) {
+      agg = monoid->combine(agg, monoid->measure(node->child[i]));
+    }
+  }
+  else {
+    for (uint32_t i = 0; i < PVEC_BRANCHING && node->child[i] != NULL; i++) {
+      agg = monoid->combine(agg, node->child[i]->agg);
+    }
+  }
+  node->agg = agg;
+}
+
+// measure_path recomputes the aggregates of the path of nodes from the root of
+// pvec towards index, bottom up.
+static void measure_path(Node **path, uint32_t length, const Pvec *pvec,
+                         uint32_t index) {
+  uint32_t leaf_start = index & ~PVEC_MASK;
+  uint32_t count = 0;
+  if (pvec->size > leaf_start) {
+    count = pvec->size - leaf_start;
+    if (count > PVEC_BRANCHING) {
+      count = PVEC_BRANCHING;
+    }
+  }
+  for (uint32_t i = length; i > 0; i--) {
+    node_measure(pvec->monoid, path[i - 1], pvec->shift - (i - 1) * PVEC_BITS,
+                 count);
+  }
+}
+
+static int exceeds(PvecAgg agg, void *ctx) {
+  return agg > *(PvecAgg *) ctx;
+}
+
+static PvecAgg min_measure(const void *elt) {
+  return (PvecAgg) (intptr_t) elt;
+}
+
+static PvecAgg min_combine(PvecAgg a, PvecAgg b) {
+  return a < b ? a : b;
+}
+
+int main() {
+  const PvecMonoid min_monoid = {.identity = INT64_MAX, .measure = min_measure,
+                                 .combine = min_combine};
+  const Pvec *sums = pvec_create();
+  const Pvec *mins = pvec_create_monoid(&min_monoid);
+  for (uintptr_t i = 0; i < 100; i++) {
+    sums = pvec_push(sums, (void *) (i + 1));
+    mins = pvec_push(mins, (void *) ((i * 37) % 101));
+  }
+  // The sum of 11 to 20, and the minimum among the elements 50 to 59.
+  printf("sum [10, 20) = %ld\n", (long) pvec_aggregate(sums, 10, 20));
+  printf("min [50, 60) = %ld\n", (long) pvec_aggregate(mins, 50, 60));
+  const Pvec *updated = pvec_update(sums, 15, (void *) 1000);
+  printf("sum [10, 20) = %ld after an update, %ld before\n",
+         (long) pvec_aggregate(updated, 10, 20), (long) pvec_aggregate(sums, 10, 20));
+  // The first index where the sum 1 + 2 + ... exceeds 1000, 1 + ... + 45 = 1035.
+  PvecAgg threshold = 1000;
+  printf("first prefix sum > 1000 ends at %u\n",
+         pvec_search_prefix(sums, exceeds, &threshold));
+}
@@ -0,0 +1,636 @@
+/*
+ * Copyright (c) 2014 Jean Niklas L'orange. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * This is a reference counted implementation of a persistent vector. It is the
+ * vanilla implementation where every node and vector head keeps track of how
+ * many references there are to it. This lets us free memory without a garbage
+ * collector, but more interestingly, it lets us detect when a node is only
+ * referred to by the vector we are about to throw away. Such nodes can be
+ * modified in place instead of copied, which is what the _owned functions do.
+ *
+ * The reference counts are not atomic, so vectors cannot be shared between
+ * threads.
+ *
+ * With PVEC_EPOCH defined, other threads may read the vectors through
+ * epoch-based reclamation: Readers announce that they are reading with
+ * pvec_epoch_enter and pvec_epoch_exit, and never touch a reference count.
+ * Memory released by the writer is not freed until no reader can be looking at
+ * it. There must still only be one writer at a time, and as readers may look at
+ * any vector, nodes are never modified in place.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#define REFCOUNT_PVEC
+#include "pvec.h"
+#include "pvec_alloc.h"
+
+#ifdef PVEC_EPOCH
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#endif
+
+// This is a trie node. It is always the branching factor size (unused table
+// entries will be NULL). For leaf nodes, the entries are the elements, which
+// are not reference counted.
+typedef struct Node {
+  // The number of references to this node. 0 means that the node is static and
+  // will never be freed.
+  uint32_t refs;
+  struct Node *child[PVEC_BRANCHING];
+} Node;
+
+struct _Pvec {
+  // The number of references to this vector head. 0 means that the vector head
+  // is static and will never be freed.
+  uint32_t refs;
+  // The size of the vector.
+  uint32_t size;
+  // The height of the vector, represented as a shift.
+  uint32_t shift;
+  // The root of the vector.
+  Node* root;
+};
+
+static Node EMPTY_NODE = {.refs = 0, .child = {0}};
+
+// An empty vector. (Not necessarily the only empty vector!)
+static Pvec EMPTY_VECTOR = {.refs = 0, .size = 0, .shift = 0, .root = &EMPTY_NODE};
+
+// These are just prototypes -- no need to worry about these.
+static inline Node *node_create(void);
+static inline Node *node_retain(Node *node);
+static void node_release(Node *node, uint32_t shift);
+static inline Node *node_make_mut(Node *node, uint32_t shift);
+static inline Pvec* pvec_make_mut(const Pvec *pvec);
+
+#ifdef PVEC_EPOCH
+static void epoch_retire(void *ptr);
+// Released memory goes through epoch_retire, and nodes are always copied.
+#define RECLAIM epoch_retire
+#define MODIFY_IN_PLACE 0
+#else
+#define RECLAIM PVEC_FREE
+#define MODIFY_IN_PLACE 1
+#endif
+
+// pvec_create just returns the empty vector.
+const Pvec* pvec_create() {
+  return &EMPTY_VECTOR;
+}
+
+// pvec_count just returns the size value inside the vector head.
+uint32_t pvec_count(const Pvec *pvec) {
+  return pvec->size;
+}
+
+const Pvec* pvec_retain(const Pvec *pvec) {
+  Pvec *mut = (Pvec *) pvec;
+  if (mut->refs != 0) {
+    mut->refs++;
+  }
+  return pvec;
+}
+
+void pvec_release(const Pvec *pvec) {
+  Pvec *mut = (Pvec *) pvec;
+  if (mut->refs == 0) {
+    return;
+  }
+  mut->refs--;
+  if (mut->refs == 0) {
+    node_release(mut->root, mut->shift);
+    RECLAIM(mut);
+  }
+}
+
+void* pvec_nth(const Pvec *pvec, uint32_t index) {
+  Node *node = pvec->root;
+  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    node = node->child[subindex];
+  }
+  return (void *) node->child[index & PVEC_MASK];
+}
+
+void* pvec_peek(const Pvec *pvec) {
+  return pvec_nth(pvec, pvec_count(pvec) - 1);
+}
+
+// The persistent functions are implemented through the owned ones: By taking
+// an extra reference to the input, every node on the path we walk is shared,
+// and is therefore copied instead of modified.
+
+const Pvec* pvec_update(const Pvec *restrict pvec, uint32_t index,
+                        const void *restrict elt) {
+  return pvec_update_owned(pvec_retain(pvec), index, elt);
+}
+
+const Pvec* pvec_push(const Pvec *restrict pvec, const void *restrict elt) {
+  return pvec_push_owned(pvec_retain(pvec), elt);
+}
+
+const Pvec* pvec_pop(const Pvec *pvec) {
+  return pvec_pop_owned(pvec_retain(pvec));
+}
+
+const Pvec* pvec_update_owned(const Pvec *restrict pvec, uint32_t index,
+                              const void *restrict elt) {
+  Pvec *mut = pvec_make_mut(pvec);
+  mut->root = node_make_mut(mut->root, mut->shift);
+  Node *node = mut->root;
+  for (uint32_t s = mut->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    node->child[subindex] = node_make_mut(node->child[subindex], s - PVEC_BITS);
+    node = node->child[subindex];
+  }
+  node->child[index & PVEC_MASK] = (Node *) elt;
+  return (const Pvec*) mut;
+}
+
+const Pvec* pvec_push_owned(const Pvec *restrict pvec, const void *restrict elt) {
+  Pvec *mut = pvec_make_mut(pvec);
+  uint32_t index = mut->size;
+  mut->size++;
+  // this is the d_full(P) check for bit vectors
+  if (index == ((uint64_t) PVEC_BRANCHING << mut->shift)) {
+    // The new root takes over our reference to the old root.
+    Node *new_root = node_create();
+    new_root->child[0] = mut->root;
+    mut->root = new_root;
+    mut->shift += PVEC_BITS;
+  }
+  else {
+    mut->root = node_make_mut(mut->root, mut->shift);
+  }
+  Node *node = mut->root;
+  for (uint32_t s = mut->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    if (node->child[subindex] == NULL) {
+      node->child[subindex] = node_create();
+    }
+    else {
+      node->child[subindex] = node_make_mut(node->child[subindex], s - PVEC_BITS);
+    }
+    node = node->child[subindex];
+  }
+  node->child[index & PVEC_MASK] = (Node *) elt;
+  return (const Pvec*) mut;
+}
+
+const Pvec* pvec_pop_owned(const Pvec *pvec) {
+  Pvec *mut = pvec_make_mut(pvec);
+  uint32_t index = mut->size - 1;
+  mut->size--;
+  if (mut->size == (1u << mut->shift) && mut->shift > 0) {
+    Node *old_root = mut->root;
+    mut->root = node_retain(old_root->child[0]);
+    node_release(old_root, mut->shift);
+    mut->shift -= PVEC_BITS;
+    return (const Pvec*) mut;
+  }
+  mut->root = node_make_mut(mut->root, mut->shift);
+  Node *node = mut->root;
+  for (uint32_t s = mut->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    if ((index & ((1u << s) - 1)) == 0) {
+      // The last element is the only element in this subtree.
+      node_release(node->child[subindex], s - PVEC_BITS);
+      node->child[subindex] = NULL;
+      return (const Pvec*) mut;
+    }
+    node->child[subindex] = node_make_mut(node->child[subindex], s - PVEC_BITS);
+    node = node->child[subindex];
+  }
+  node->child[index & PVEC_MASK] = NULL;
+  return (const Pvec*) mut;
+}
+
+const Pvec* pvec_right_slice(const Pvec *pvec, uint32_t new_size) {
+  Pvec *mut = pvec_make_mut(pvec_retain(pvec));
+  uint32_t index = new_size;
+  mut->size = new_size;
+
+  // We have to cut the tree until the height is minimal
+  while (mut->size <= (1u << mut->shift) && mut->shift > 0) {
+    Node *old_root = mut->root;
+    mut->root = node_retain(old_root->child[0]);
+    node_release(old_root, mut->shift);
+    mut->shift -= PVEC_BITS;
+  }
+
+  // The tree being fully dense is a special case, and is short-circuited
+  if (mut->size == ((uint64_t) PVEC_BRANCHING << mut->shift)) {
+    return (const Pvec*) mut;
+  }
+
+  // Walk down to the first element to remove, releasing everything to the
+  // right of that path on the way.
+  mut->root = node_make_mut(mut->root, mut->shift);
+  Node *node = mut->root;
+  for (uint32_t s = mut->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    uint32_t keep = ((index & ((1u << s) - 1)) == 0) ? subindex : subindex + 1;
+    for (uint32_t i = keep; i < PVEC_BRANCHING; i++) {
+      node_release(node->child[i], s - PVEC_BITS);
+      node->child[i] = NULL;
+    }
+    if (keep == subindex) {
+      return (const Pvec*) mut;
+    }
+    node->child[subindex] = node_make_mut(node->child[subindex], s - PVEC_BITS);
+    node = node->child[subindex];
+  }
+  uint32_t subindex = index & PVEC_MASK;
+  memset(&node->child[subindex], 0,
+         (PVEC_BRANCHING - subindex) * sizeof(Node *));
+  return (const Pvec*) mut;
+}
+
+// Inline helper functions
+
+static inline Node *node_create(void) {
+  Node *new = PVEC_MALLOC(sizeof(Node));
+  new->refs = 1;
+  return new;
+}
+
+static inline Node *node_retain(Node *node) {
+  if (node != NULL && node->refs != 0) {
+    node->refs++;
+  }
+  return node;
+}
+
+// node_release needs the shift of the node to know whether the children are
+// nodes or elements.
+static void node_release(Node *node, uint32_t shift) {
+  if (node == NULL || node->refs == 0) {
+    return;
+  }
+  node->refs--;
+  if (node->refs == 0) {
+    if (shift > 0) {
+      for (uint32_t i = 0; i < PVEC_BRANCHING; i++) {
+        node_release(node->child[i], shift - PVEC_BITS);
+      }
+    }
+    RECLAIM(node);
+  }
+}
+
+// node_make_mut takes over a reference to node, and returns a node with the
+// same contents which is safe to modify. If we hold the only reference to node,
+// that is node itself. Otherwise it is a copy, and our reference to the
+// original is given up.
+static inline Node *node_make_mut(Node *node, uint32_t shift) {
+  if (MODIFY_IN_PLACE && node->refs == 1) {
+    return node;
+  }
+  Node *clone = PVEC_MALLOC(sizeof(Node));
+  memcpy(clone, node, sizeof(Node));
+  clone->refs = 1;
+  if (shift > 0) {
+    for (uint32_t i = 0; i < PVEC_BRANCHING; i++) {
+      node_retain(clone->child[i]);
+    }
+  }
+  node_release(node, shift);
+  return clone;
+}
+
+// pvec_make_mut is node_make_mut for vector heads.
+static inline Pvec* pvec_make_mut(const Pvec *pvec) {
+  if (MODIFY_IN_PLACE && pvec->refs == 1) {
+    return (Pvec *) pvec;
+  }
+  Pvec *clone = PVEC_MALLOC(sizeof(Pvec));
+  memcpy(clone, pvec, sizeof(Pvec));
+  clone->refs = 1;
+  node_retain(clone->root);
+  pvec_release(pvec);
+  return clone;
+}
+
+#ifdef PVEC_EPOCH
+
+// Epoch-based reclamation. There is a global epoch, which only moves forward.
+// Memory released in epoch e is put in the limbo list for e. The epoch may only
+// go from e to e + 1 when every reader inside a critical section has seen e.
+// At that point, readers which started before e - 1 have all left, so nothing
+// can refer to the memory released in e - 2, and it is freed.
+
+// PVEC_EPOCH_BATCH is the number of releases between each attempt to advance
+// the epoch.
+#ifndef PVEC_EPOCH_BATCH
+#define PVEC_EPOCH_BATCH 64
+#endif
+
+typedef struct EpochReader {
+  // 0 if the reader is outside a critical section, otherwise 2 * epoch + 1,
+  // where epoch is the epoch it saw when it entered.
+  _Atomic uint64_t state;
+  struct EpochReader *next;
+} EpochReader;
+
+// Every thread which has read gets a record here. Records are never removed.
+static _Atomic(EpochReader *) readers = NULL;
+static _Thread_local EpochReader *local_reader = NULL;
+
+static _Atomic uint64_t global_epoch = 0;
+
+// The limbo lists are only touched by the writer.
+typedef struct {
+  void **ptrs;
+  uint32_t count;
+  uint32_t capacity;
+} Limbo;
+
+static Limbo limbo[3];
+static uint32_t retired_since_advance = 0;
+
+void pvec_epoch_enter(void) {
+  EpochReader *reader = local_reader;
+  if (reader == NULL) {
+    reader = calloc(1, sizeof(EpochReader));
+    reader->next = atomic_load(&readers);
+    while (!atomic_compare_exchange_weak(&readers, &reader->next, reader)) {
+    }
+    local_reader = reader;
+  }
+  // Loads of nodes must not happen before the writer can see us, so the store
+  // and load below are sequentially consistent.
+  atomic_store(&reader->state, 1);
+  atomic_store(&reader->state, 2 * atomic_load(&global_epoch) + 1);
+}
+
+void pvec_epoch_exit(void) {
+  atomic_store_explicit(&local_reader->state, 0, memory_order_release);
+}
+
+static void limbo_free(Limbo *list) {
+  for (uint32_t i = 0; i < list->count; i++) {
+    PVEC_FREE(list->ptrs[i]);
+  }
+  list->count = 0;
+}
+
+// epoch_try_advance moves the global epoch forward if every reader has seen the
+// current one, and returns whether it did.
+static int epoch_try_advance(void) {
+  uint64_t epoch = atomic_load(&global_epoch);
+  for (EpochReader *r = atomic_load(&readers); r != NULL; r = r->next) {
+    uint64_t state = atomic_load(&r->state);
+    // A state of 1 means the reader has not picked an epoch yet. It may pick
+    // this one, but we cannot know, so we wait.
+    if (state != 0 && state != 2 * epoch + 1) {
+      return 0;
+    }
+  }
+  // (epoch + 1) % 3 is the list of epoch - 2.
+  limbo_free(&limbo[(epoch + 1) % 3]);
+  atomic_store(&global_epoch, epoch + 1);
+  retired_since_advance = 0;
+  return 1;
+}
+
+static void epoch_retire(void *ptr) {
+  Limbo *list = &limbo[atomic_load_explicit(&global_epoch, memory_order_relaxed) % 3];
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity == 0 ? 64 : 2 * list->capacity;
+    list->ptrs = PVEC_REALLOC(list->ptrs, list->capacity * sizeof(void *));
+  }
+  list->ptrs[list->count++] = ptr;
+  if (++retired_since_advance >= PVEC_EPOCH_BATCH) {
+    epoch_try_advance();
+  }
+}
+
+void pvec_epoch_synchronize(void) {
+  // After three advances, everything released before the call is freed.
+  for (int advanced = 0; advanced < 3;) {
+    if (epoch_try_advance()) {
+      advanced++;
+    }
+    else {
+      sched_yield();
+    }
+  }
+}
+#endif
+
+// Random operations on a handful of live versions, checked against plain
+// arrays. Every version holds one reference, and is checked after each step:
+// An owned operation modifying a node another version still refers to, or a
+// release freeing one, shows up as a bad element (or as an error from a memory
+// checker).
+
+#define RANDOM_VERSIONS 8
+#define RANDOM_MAX_SIZE 300
+
+typedef struct {
+  const Pvec *pvec;
+  uint32_t size;
+  uintptr_t elts[RANDOM_MAX_SIZE];
+} RandomVersion;
+
+static void example_random_ops(uint32_t steps) {
+  static RandomVersion versions[RANDOM_VERSIONS];
+  for (int v = 0; v < RANDOM_VERSIONS; v++) {
+    versions[v].pvec = pvec_create();
+    versions[v].size = 0;
+  }
+  for (uint32_t step = 0; step < steps; step++) {
+    RandomVersion *from = &versions[rand() % RANDOM_VERSIONS];
+    RandomVersion *to = &versions[rand() % RANDOM_VERSIONS];
+    RandomVersion next = *from;
+    uintptr_t elt = step + 1;
+    // Owned operations consume a reference, so we give them a new one unless
+    // the result replaces the input.
+    const Pvec *in = (from == to) ? from->pvec : pvec_retain(from->pvec);
+    int op = rand() % 8;
+    if (next.size == RANDOM_MAX_SIZE && op < 2) {
+      op = 2 + rand() % 6;
+    }
+    if (next.size == 0 && op >= 2) {
+      op = rand() % 2;
+    }
+    switch (op) {
+    case 0:
+      next.pvec = pvec_push(in, (void *) elt);
+      pvec_release(in);
+      next.elts[next.size++] = elt;
+      break;
+    case 1:
+      next.pvec = pvec_push_owned(in, (void *) elt);
+      next.elts[next.size++] = elt;
+      break;
+    case 2:
+      next.pvec = pvec_pop(in);
+      pvec_release(in);
+      next.size--;
+      break;
+    case 3:
+      next.pvec = pvec_pop_owned(in);
+      next.size--;
+      break;
+    case 4: {
+      uint32_t index = rand() % next.size;
+      next.pvec = pvec_update(in, index, (void *) elt);
+      pvec_release(in);
+      next.elts[index] = elt;
+      break;
+    }
+    case 5: {
+      uint32_t index = rand() % next.size;
+      next.pvec = pvec_update_owned(in, index, (void *) elt);
+      next.elts[index] = elt;
+      break;
+    }
+    default:
+      next.size = rand() % (next.size + 1);
+      next.pvec = pvec_right_slice(in, next.size);
+      pvec_release(in);
+      break;
+    }
+    if (from != to) {
+      pvec_release(to->pvec);
+    }
+    *to = next;
+    for (int v = 0; v < RANDOM_VERSIONS; v++) {
+      if (pvec_count(versions[v].pvec) != versions[v].size) {
+        printf("Random operations, step %u, version %d has the wrong size\n",
+               step, v);
+        continue;
+      }
+      for (uint32_t i = 0; i < versions[v].size; i++) {
+        if ((uintptr_t) pvec_nth(versions[v].pvec, i) != versions[v].elts[i]) {
+          printf("Random operations, step %u, version %d not ok at %u\n",
+                 step, v, i);
+          break;
+        }
+      }
+    }
+  }
+  for (int v = 0; v < RANDOM_VERSIONS; v++) {
+    pvec_release(versions[v].pvec);
+  }
+}
+
+#ifdef PVEC_EPOCH
+
+// The vector the writer has published, and whether it is done.
+static _Atomic(const Pvec *) published;
+static _Atomic int writer_done = 0;
+
+// Readers check that element i is i + 1 in whatever vector is published. They
+// hold no references to it, so the writer may release it while they read.
+static void *example_reader(void *arg) {
+  uint64_t *reads = arg;
+  while (!atomic_load(&writer_done)) {
+    pvec_epoch_enter();
+    const Pvec *p = atomic_load(&published);
+    for (uint32_t i = 0; i < pvec_count(p); i++) {
+      if ((uintptr_t) pvec_nth(p, i) != i + 1) {
+        printf("Reader saw a bad element at %u\n", i);
+      }
+    }
+    pvec_epoch_exit();
+    (*reads)++;
+  }
+  return NULL;
+}
+
+int main() {
+  atomic_store(&published, pvec_create());
+  pthread_t threads[4];
+  uint64_t reads[4] = {0};
+  for (int i = 0; i < 4; i++) {
+    pthread_create(&threads[i], NULL, example_reader, &reads[i]);
+  }
+  // Grow and shrink the vector a couple of times, releasing every version as
+  // soon as the next one is published.
+  for (int round = 0; round < 10; round++) {
+    for (uintptr_t i = 0; i < 1000; i++) {
+      const Pvec *old = atomic_load(&published);
+      atomic_store(&published, pvec_push(old, (void *) (i + 1)));
+      pvec_release(old);
+    }
+    while (pvec_count(atomic_load(&published)) > 0) {
+      const Pvec *old = atomic_load(&published);
+      atomic_store(&published, pvec_pop(old));
+      pvec_release(old);
+    }
+  }
+  atomic_store(&writer_done, 1);
+  uint64_t total = 0;
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+    total += reads[i];
+  }
+  pvec_release(atomic_load(&published));
+  // Without readers around, the writer can still use every operation.
+  example_random_ops(20000);
+  pvec_epoch_synchronize();
+  printf("%lu reads done\n", total);
+}
+
+#else
+
+int main() {
+  // Owned operations on a vector nobody else refers to mutate it in place.
+  const Pvec *p = pvec_create();
+  for (uintptr_t i = 0; i < 100; i++) {
+    p = pvec_push_owned(p, (void *) (i + 1));
+  }
+  // Taking a reference to p before updating it keeps p intact, and the result
+  // only shares the untouched nodes with it.
+  const Pvec *q = pvec_update_owned(pvec_retain(p), 42, (void *) 0);
+  for (uint32_t i = 0; i < 100; i++) {
+    uintptr_t n = (uintptr_t) pvec_nth(p, i);
+    uintptr_t m = (uintptr_t) pvec_nth(q, i);
+    if (n != i + 1 || m != (i == 42 ? 0 : i + 1)) {
+      printf("For %u, not ok\n", i);
+    }
+  }
+  pvec_release(q);
+  while (pvec_count(p) > 0) {
+    uint32_t size = pvec_count(p);
+    const Pvec *r = pvec_right_slice(p, size / 2);
+    for (uint32_t i = 0; i < size / 2; i++) {
+      if ((uintptr_t) pvec_nth(r, i) != i + 1) {
+        printf("Slice to %u, not ok\n", size / 2);
+      }
+    }
+    pvec_release(r);
+    p = pvec_pop_owned(p);
+  }
+  pvec_release(p);
+  example_random_ops(20000);
+}
+
+#endif
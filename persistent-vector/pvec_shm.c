@@ -0,0 +1,384 @@
+/*
+ * Copyright (c) 2014 Jean Niklas L'orange. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * This is the vanilla implementation of a persistent vector, placed in a POSIX
+ * shared memory segment so that several processes can use the same vectors.
+ * Since the segment is mapped at different addresses in different processes,
+ * nodes refer to each other by their offset into the segment instead of by
+ * pointer. Offset 0 is the segment head, so it doubles as NULL.
+ *
+ * Memory is handed out by a lock-free bump allocator in the segment head, and
+ * is never reclaimed. Publishing a new version is a compare-and-swap on the
+ * offset of the current vector head, so readers never wait for writers.
+ *
+ * Elements are stored as they are, so they should be values or offsets which
+ * make sense in every process, not pointers.
+ */
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define SHM_PVEC
+#include "pvec.h"
+
+#define SHM_MAGIC 0x7076656373686d31ULL // "pvecshm1"
+
+// This is a trie node. It is always the branching factor size (unused table
+// entries will be 0). Interior nodes contain offsets, leaves elements.
+typedef struct Node {
+  uint64_t child[PVEC_BRANCHING];
+} Node;
+
+struct _Pvec {
+  // The size of the vector.
+  uint32_t size;
+  // The height of the vector, represented as a shift.
+  uint32_t shift;
+  // The offset of the root of the vector.
+  uint64_t root;
+};
+
+// The segment head lives at offset 0 of the segment. It is followed by the
+// empty vector and its root node.
+typedef struct {
+  // SHM_MAGIC once the segment is initialised.
+  _Atomic uint64_t magic;
+  // The size of the segment in bytes.
+  uint64_t size;
+  // The offset of the first free byte in the segment.
+  _Atomic uint64_t top;
+  // The offset of the current vector head.
+  _Atomic uint64_t current;
+  Pvec empty_vector;
+  Node empty_node;
+} SegmentHead;
+
+// The segment mapped by this process.
+static SegmentHead *segment = NULL;
+
+// These are just prototypes -- no need to worry about these.
+static inline Node *node_at(uint64_t offset);
+static inline uint64_t offset_of(const void *ptr);
+static inline Node *node_create(void);
+static inline Node *node_clone(const Node* node);
+static inline Pvec* pvec_clone(const Pvec *pvec);
+
+int pvec_shm_open(const char *name, uint64_t size) {
+  int creator = 1;
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    creator = 0;
+    fd = shm_open(name, O_RDWR, 0600);
+  }
+  if (fd < 0) {
+    return -1;
+  }
+  if (creator) {
+    if (ftruncate(fd, size) < 0) {
+      close(fd);
+      return -1;
+    }
+  }
+  else {
+    // The creator may not have set the size yet.
+    struct stat st;
+    do {
+      if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+      }
+    } while (st.st_size == 0 && sched_yield() == 0);
+    size = st.st_size;
+  }
+  void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return -1;
+  }
+  segment = base;
+  if (creator) {
+    // ftruncate zeroes the segment, so the empty vector and node are already
+    // in place apart from the root offset.
+    segment->size = size;
+    segment->empty_vector.root = offset_of(&segment->empty_node);
+    atomic_store(&segment->top, sizeof(SegmentHead));
+    atomic_store(&segment->current, offset_of(&segment->empty_vector));
+    atomic_store_explicit(&segment->magic, SHM_MAGIC, memory_order_release);
+  }
+  else {
+    while (atomic_load_explicit(&segment->magic, memory_order_acquire) != SHM_MAGIC) {
+      sched_yield();
+    }
+  }
+  return 0;
+}
+
+void pvec_shm_close(void) {
+  munmap(segment, segment->size);
+  segment = NULL;
+}
+
+int pvec_shm_unlink(const char *name) {
+  return shm_unlink(name);
+}
+
+const Pvec* pvec_shm_current(void) {
+  uint64_t current = atomic_load_explicit(&segment->current, memory_order_acquire);
+  return (const Pvec *) ((uint8_t *) segment + current);
+}
+
+int pvec_shm_publish(const Pvec *expected, const Pvec *pvec) {
+  uint64_t old = offset_of(expected);
+  // The release makes the nodes of pvec visible to processes reading it.
+  return atomic_compare_exchange_strong_explicit(&segment->current, &old,
+                                                 offset_of(pvec),
+                                                 memory_order_release,
+                                                 memory_order_relaxed);
+}
+
+// pvec_create just returns the empty vector.
+const Pvec* pvec_create() {
+  return &segment->empty_vector;
+}
+
+// pvec_count just returns the size value inside the vector head.
+uint32_t pvec_count(const Pvec *pvec) {
+  return pvec->size;
+}
+
+void* pvec_nth(const Pvec *pvec, uint32_t index) {
+  Node *node = node_at(pvec->root);
+  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    node = node_at(node->child[subindex]);
+  }
+  return (void *) (uintptr_t) node->child[index & PVEC_MASK];
+}
+
+void* pvec_peek(const Pvec *pvec) {
+  return pvec_nth(pvec, pvec_count(pvec) - 1);
+}
+
+const Pvec* pvec_update(const Pvec *restrict pvec, uint32_t index,
+                        const void *restrict elt) {
+  Pvec *clone = pvec_clone(pvec);
+  Node *node = node_clone(node_at(pvec->root));
+  clone->root = offset_of(node);
+  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    Node *child = node_clone(node_at(node->child[subindex]));
+    node->child[subindex] = offset_of(child);
+    node = child;
+  }
+  node->child[index & PVEC_MASK] = (uintptr_t) elt;
+  return (const Pvec*) clone;
+}
+
+const Pvec* pvec_push(const Pvec *restrict pvec, const void *restrict elt) {
+  Pvec *clone = pvec_clone(pvec);
+  uint32_t index = pvec_count(pvec);
+  clone->size = pvec->size + 1;
+  Node *node;
+  // this is the d_full(P) check for bit vectors
+  if (pvec_count(pvec) == ((uint64_t) PVEC_BRANCHING << pvec->shift)) {
+    node = node_create();
+    node->child[0] = pvec->root;
+    clone->shift = pvec->shift + PVEC_BITS;
+  }
+  else {
+    node = node_clone(node_at(pvec->root));
+  }
+  clone->root = offset_of(node);
+  for (uint32_t s = clone->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    Node *child;
+    if (node->child[subindex] == 0) { // the create part of clone-or-create
+      child = node_create();
+    }
+    else { // the clone part of clone-or-create
+      child = node_clone(node_at(node->child[subindex]));
+    }
+    node->child[subindex] = offset_of(child);
+    node = child;
+  }
+  node->child[index & PVEC_MASK] = (uintptr_t) elt;
+  return (const Pvec*) clone;
+}
+
+const Pvec* pvec_pop(const Pvec *pvec) {
+  Pvec *clone = pvec_clone(pvec);
+  uint32_t index = pvec_count(pvec) - 1;
+  clone->size = pvec_count(pvec) - 1;
+  if (pvec_count(clone) == (1u << pvec->shift) && pvec->shift > 0) {
+    clone->shift = pvec->shift - PVEC_BITS;
+    clone->root = node_at(pvec->root)->child[0];
+    return clone;
+  }
+  Node *node = node_clone(node_at(pvec->root));
+  clone->root = offset_of(node);
+  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    if ((index & ((1u << s) - 1)) == 0) {
+      node->child[subindex] = 0;
+      return clone;
+    }
+    Node *child = node_clone(node_at(node->child[subindex]));
+    node->child[subindex] = offset_of(child);
+    node = child;
+  }
+  node->child[index & PVEC_MASK] = 0;
+  return clone;
+}
+
+const Pvec* pvec_right_slice(const Pvec *pvec, uint32_t new_size) {
+  Pvec *clone = pvec_clone(pvec);
+  uint32_t index = new_size;
+  clone->size = new_size;
+
+  // We have to cut the tree until the height is minimal
+  while (pvec_count(clone) <= (1u << clone->shift) && clone->shift > 0) {
+    clone->shift = clone->shift - PVEC_BITS;
+    clone->root = node_at(clone->root)->child[0];
+  }
+
+  // The tree being fully dense is a special case, and is short-circuited
+  if (pvec_count(clone) == ((uint64_t) PVEC_BRANCHING << clone->shift)) {
+    return clone;
+  }
+
+  Node *node = node_clone(node_at(clone->root));
+  clone->root = offset_of(node);
+  for (uint32_t s = clone->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    if ((index & ((1u << s) - 1)) == 0) {
+      memset(&node->child[subindex], 0,
+             (PVEC_BRANCHING - subindex) * sizeof(uint64_t));
+      return clone;
+    }
+    Node *child = node_clone(node_at(node->child[subindex]));
+    node->child[subindex] = offset_of(child);
+    memset(&node->child[subindex + 1], 0,
+           (PVEC_BRANCHING - (subindex + 1)) * sizeof(uint64_t));
+    node = child;
+  }
+  uint32_t subindex = index & PVEC_MASK;
+  memset(&node->child[subindex], 0,
+         (PVEC_BRANCHING - subindex) * sizeof(uint64_t));
+  return clone;
+}
+
+// Inline helper functions
+
+static inline Node *node_at(uint64_t offset) {
+  return (Node *) ((uint8_t *) segment + offset);
+}
+
+static inline uint64_t offset_of(const void *ptr) {
+  return (const uint8_t *) ptr - (const uint8_t *) segment;
+}
+
+// shm_alloc is the bump allocator. The segment is zeroed when it is created and
+// memory is never reused, so the memory returned is always nulled.
+static void *shm_alloc(uint64_t size) {
+  size = (size + 7) & ~(uint64_t) 7;
+  uint64_t offset = atomic_fetch_add_explicit(&segment->top, size,
+                                              memory_order_relaxed);
+  if (offset + size > segment->size) {
+    fprintf(stderr, "pvec: shared memory segment is full\n");
+    abort();
+  }
+  return (uint8_t *) segment + offset;
+}
+
+static inline Node *node_create(void) {
+  return shm_alloc(sizeof(Node));
+}
+
+static inline Node *node_clone(const Node* node) {
+  Node *clone = shm_alloc(sizeof(Node));
+  memcpy(clone, node, sizeof(Node));
+  return clone;
+}
+
+static inline Pvec* pvec_clone(const Pvec *pvec) {
+  Pvec *clone = shm_alloc(sizeof(Pvec));
+  memcpy(clone, pvec, sizeof(Pvec));
+  return clone;
+}
+
+int main() {
+  const char *name = "/pvec-shm-example";
+  pvec_shm_unlink(name);
+  if (pvec_shm_open(name, 1 << 24) < 0) {
+    perror("pvec_shm_open");
+    return 1;
+  }
+  // Two writer processes push their own elements onto the current vector,
+  // retrying whenever the other one published first.
+  fflush(stdout);
+  pid_t pids[2];
+  for (uintptr_t w = 0; w < 2; w++) {
+    pids[w] = fork();
+    if (pids[w] == 0) {
+      for (uintptr_t i = 0; i < 1000; i++) {
+        const Pvec *current, *next;
+        do {
+          current = pvec_shm_current();
+          next = pvec_push(current, (void *) (w * 1000 + i + 1));
+        } while (!pvec_shm_publish(current, next));
+      }
+      exit(0);
+    }
+  }
+  // Meanwhile, this process reads whatever version is current.
+  uint32_t versions_seen = 0;
+  uint32_t last_size = 0;
+  while (last_size < 2000) {
+    const Pvec *p = pvec_shm_current();
+    if (pvec_count(p) != last_size) {
+      last_size = pvec_count(p);
+      versions_seen++;
+    }
+  }
+  waitpid(pids[0], NULL, 0);
+  waitpid(pids[1], NULL, 0);
+
+  const Pvec *p = pvec_shm_current();
+  uintptr_t sum = 0;
+  for (uint32_t i = 0; i < pvec_count(p); i++) {
+    sum += (uintptr_t) pvec_nth(p, i);
+  }
+  printf("size %u, sum %lu (expected 2001000), saw %u versions\n",
+         pvec_count(p), (unsigned long) sum, versions_seen);
+  pvec_shm_close();
+  pvec_shm_unlink(name);
+}
@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2014 Jean Niklas L'orange. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * This is the vanilla implementation of a persistent vector, except that
+ * vectors with at most PVEC_SMALL_SIZE elements store them directly in the
+ * vector head instead of in a trie. Small vectors therefore need a single
+ * allocation per version, and lookups do not follow any pointer besides the
+ * one to the head.
+ *
+ * Heads are only as large as they have to be: A small vector with n elements
+ * has room for n elements, and a trie vector only for its shift and root. Both
+ * kinds of heads start with a Pvec containing the size, which tells which kind
+ * a head is. A vector turns
+ * into a trie when it is pushed past PVEC_SMALL_SIZE elements, and back into a
+ * small vector when it is popped or sliced down to PVEC_SMALL_SIZE elements.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "pvec.h"
+#include "pvec_alloc.h"
+
+#ifndef PVEC_SMALL_SIZE
+// PVEC_SMALL_SIZE is the largest number of elements stored inline in the
+// vector head. Larger values avoid tries for more vectors, but every push or
+// update of a small vector copies all its elements. It must be at least 1.
+#define PVEC_SMALL_SIZE 8
+#endif
+
+// This is a trie node. It is always the branching factor size (unused table
+// entries will be NULL).
+typedef struct Node {
+  struct Node *child[PVEC_BRANCHING];
+} Node;
+
+// The part shared by both kinds of heads.
+struct _Pvec {
+  // The size of the vector.
+  uint32_t size;
+};
+
+// The head of a vector with at most PVEC_SMALL_SIZE elements.
+typedef struct {
+  Pvec pvec;
+  // The elements. Only size of them are allocated.
+  void *elts[];
+} SmallPvec;
+
+// The head of a vector with more than PVEC_SMALL_SIZE elements.
+typedef struct {
+  Pvec pvec;
+  // The height of the trie, represented as a shift.
+  uint32_t shift;
+  // The root of the trie.
+  Node *root;
+} TriePvec;
+
+#define IS_SMALL(pvec) ((pvec)->size <= PVEC_SMALL_SIZE)
+
+// An empty vector. (Not necessarily the only empty vector!)
+static SmallPvec EMPTY_VECTOR = {.pvec = {.size = 0}};
+
+// These are just prototypes -- no need to worry about these.
+static inline Node *node_create(void);
+static inline Node *node_clone(const Node* node);
+static inline SmallPvec *small_create(uint32_t size);
+static inline TriePvec *trie_clone(const TriePvec *trie);
+static const Pvec *small_from_trie(const Pvec *pvec, uint32_t size);
+static const Pvec *trie_from_small(const SmallPvec *small, const void *elt);
+
+// as_small and as_trie return the head pvec is the start of.
+static inline const SmallPvec *as_small(const Pvec *pvec) {
+  return (const SmallPvec *) pvec;
+}
+
+static inline const TriePvec *as_trie(const Pvec *pvec) {
+  return (const TriePvec *) pvec;
+}
+
+// pvec_create just returns the empty vector.
+const Pvec* pvec_create() {
+  return &EMPTY_VECTOR.pvec;
+}
+
+// pvec_count just returns the size value inside the vector head.
+uint32_t pvec_count(const Pvec *pvec) {
+  return pvec->size;
+}
+
+void* pvec_nth(const Pvec *pvec, uint32_t index) {
+  if (IS_SMALL(pvec)) {
+    return as_small(pvec)->elts[index];
+  }
+  const TriePvec *trie = as_trie(pvec);
+  Node *node = trie->root;
+  for (uint32_t s = trie->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    node = node->child[subindex];
+  }
+  return (void *) node->child[index & PVEC_MASK];
+}
+
+void* pvec_peek(const Pvec *pvec) {
+  return pvec_nth(pvec, pvec_count(pvec) - 1);
+}
+
+const Pvec* pvec_update(const Pvec *restrict pvec, uint32_t index,
+                        const void *restrict elt) {
+  if (IS_SMALL(pvec)) {
+    SmallPvec *clone = small_create(pvec->size);
+    memcpy(clone->elts, as_small(pvec)->elts, pvec->size * sizeof(void *));
+    clone->elts[index] = (void *) elt;
+    return &clone->pvec;
+  }
+  TriePvec *clone = trie_clone(as_trie(pvec));
+  Node *node = node_clone(clone->root);
+  clone->root = node;
+  for (uint32_t s = clone->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    node->child[subindex] = node_clone(node->child[subindex]);
+    node = node->child[subindex];
+  }
+  node->child[index & PVEC_MASK] = (Node *) elt;
+  return &clone->pvec;
+}
+
+const Pvec* pvec_push(const Pvec *restrict pvec, const void *restrict elt) {
+  uint32_t index = pvec_count(pvec);
+  if (index < PVEC_SMALL_SIZE) {
+    SmallPvec *clone = small_create(index + 1);
+    memcpy(clone->elts, as_small(pvec)->elts, index * sizeof(void *));
+    clone->elts[index] = (void *) elt;
+    return &clone->pvec;
+  }
+  if (index == PVEC_SMALL_SIZE) {
+    return trie_from_small(as_small(pvec), elt);
+  }
+  const TriePvec *trie = as_trie(pvec);
+  TriePvec *clone = trie_clone(trie);
+  clone->pvec.size = index + 1;
+  // this is the d_full(P) check for bit vectors
+  if (index == ((uint64_t) PVEC_BRANCHING << trie->shift)) {
+    Node *new_root = node_create();
+    new_root->child[0] = trie->root;
+    clone->root = new_root;
+    clone->shift = trie->shift + PVEC_BITS;
+  }
+  else {
+    clone->root = node_clone(trie->root);
+  }
+  Node *node = clone->root;
+  for (uint32_t s = clone->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    if (node->child[subindex] == NULL) { // the create part of clone-or-create
+      node->child[subindex] = node_create();
+    }
+    else { // the clone part of clone-or-create
+      node->child[subindex] = node_clone(node->child[subindex]);
+    }
+    node = node->child[subindex];
+  }
+  node->child[index & PVEC_MASK] = (Node *) elt;
+  return &clone->pvec;
+}
+
+const Pvec* pvec_pop(const Pvec *pvec) {
+  return pvec_right_slice(pvec, pvec_count(pvec) - 1);
+}
+
+const Pvec* pvec_right_slice(const Pvec *pvec, uint32_t new_size) {
+  if (new_size <= PVEC_SMALL_SIZE) {
+    return small_from_trie(pvec, new_size);
+  }
+  TriePvec *clone = trie_clone(as_trie(pvec));
+  uint32_t index = new_size;
+  clone->pvec.size = new_size;
+
+  // We have to cut the tree until the height is minimal
+  while (new_size <= (1u << clone->shift) && clone->shift > 0) {
+    clone->shift = clone->shift - PVEC_BITS;
+    clone->root = clone->root->child[0];
+  }
+
+  // The tree being fully dense is a special case, and is short-circuited
+  if (new_size == ((uint64_t) PVEC_BRANCHING << clone->shift)) {
+    return &clone->pvec;
+  }
+
+  Node *node = node_clone(clone->root);
+  clone->root = node;
+  for (uint32_t s = clone->shift; s > 0; s -= PVEC_BITS) {
+    uint32_t subindex = (index >> s) & PVEC_MASK;
+    if ((index & ((1u << s) - 1)) == 0) {
+      memset(&node->child[subindex], 0,
+             (PVEC_BRANCHING - subindex) * sizeof(Node *));
+      return &clone->pvec;
+    }
+    node->child[subindex] = node_clone(node->child[subindex]);
+    memset(&node->child[subindex + 1], 0,
+           (PVEC_BRANCHING - (subindex + 1)) * sizeof(Node *));
+    node = node->child[subindex];
+  }
+  uint32_t subindex = index & PVEC_MASK;
+  memset(&node->child[subindex], 0,
+         (PVEC_BRANCHING - subindex) * sizeof(Node *));
+  return &clone->pvec;
+}
+
+// small_from_trie returns a small vector with the first size elements of pvec,
+// which is either small or a trie.
+static const Pvec *small_from_trie(const Pvec *pvec, uint32_t size) {
+  if (size == 0) {
+    return pvec_create();
+  }
+  SmallPvec *small = small_create(size);
+  if (IS_SMALL(pvec)) {
+    memcpy(small->elts, as_small(pvec)->elts, size * sizeof(void *));
+    return &small->pvec;
+  }
+  // Copy a leaf at a time.
+  const TriePvec *trie = as_trie(pvec);
+  for (uint32_t i = 0; i < size; i += PVEC_BRANCHING) {
+    Node *node = trie->root;
+    for (uint32_t s = trie->shift; s > 0; s -= PVEC_BITS) {
+      node = node->child[(i >> s) & PVEC_MASK];
+    }
+    uint32_t n = size - i < PVEC_BRANCHING ? size - i : PVEC_BRANCHING;
+    memcpy(&small->elts[i], node->child, n * sizeof(void *));
+  }
+  return &small->pvec;
+}
+
+// trie_build returns a new subtree with the n given elements, with the given
+// shift.
+static Node *trie_build(void *const *elts, uint32_t n, uint32_t shift) {
+  Node *node = node_create();
+  if (shift == 0) {
+    memcpy(node->child, elts, n * sizeof(void *));
+    return node;
+  }
+  uint32_t child_size = 1u << shift;
+  for (uint32_t i = 0; i * child_size < n; i++) {
+    uint32_t start = i * child_size;
+    uint32_t m = n - start < child_size ? n - start : child_size;
+    node->child[i] = trie_build(elts + start, m, shift - PVEC_BITS);
+  }
+  return node;
+}
+
+// trie_from_small returns a trie vector with the elements of the full small
+// vector, followed by elt.
+static const Pvec *trie_from_small(const SmallPvec *small, const void *elt) {
+  void *elts[PVEC_SMALL_SIZE + 1];
+  memcpy(elts, small->elts, PVEC_SMALL_SIZE * sizeof(void *));
+  elts[PVEC_SMALL_SIZE] = (void *) elt;
+  TriePvec *trie = PVEC_MALLOC(sizeof(TriePvec));
+  trie->pvec.size = PVEC_SMALL_SIZE + 1;
+  trie->shift = 0;
+  while (((uint64_t) PVEC_BRANCHING << trie->shift) < trie->pvec.size) {
+    trie->shift += PVEC_BITS;
+  }
+  trie->root = trie_build(elts, trie->pvec.size, trie->shift);
+  return &trie->pvec;
+}
+
+// Inline helper functions
+
+static inline Node *node_create(void) {
+  Node *new = PVEC_MALLOC(sizeof(Node));
+  return new;
+}
+
+static inline Node *node_clone(const Node* node) {
+  Node *clone = PVEC_MALLOC(sizeof(Node));
+  memcpy(clone, node, sizeof(Node));
+  return clone;
+}
+
+// small_create returns a new small head with room for size elements, which are
+// left unset.
+static inline SmallPvec *small_create(uint32_t size) {
+  SmallPvec *small = PVEC_MALLOC(sizeof(SmallPvec) + size * sizeof(void *));
+  small->pvec.size = size;
+  return small;
+}
+
+static inline TriePvec *trie_clone(const TriePvec *trie) {
+  TriePvec *clone = PVEC_MALLOC(sizeof(TriePvec));
+  memcpy(clone, trie, sizeof(TriePvec));
+  return clone;
+}
+
+int main() {
+  // Small vectors only allocate a head, of 8 bytes plus 8 per element.
+  const Pvec *p = pvec_create();
+  for (uintptr_t i = 0; i < 100; i++) {
+    p = pvec_push(p, (void *) (i + 1));
+    for (uint32_t j = 0; j <= i; j++) {
+      if ((uintptr_t) pvec_nth(p, j) != j + 1) {
+        printf("For %lu, not ok\n", i);
+        break;
+      }
+    }
+  }
+  // Popping back down turns the trie into a small vector again.
+  while (pvec_count(p) > 0) {
+    p = pvec_pop(p);
+    if (pvec_count(p) > 0 && (uintptr_t) pvec_peek(p) != pvec_count(p)) {
+      printf("Pop to %u not ok\n", pvec_count(p));
+    }
+  }
+  printf("small vectors hold up to %d elements inline, %zu bytes for %d\n",
+         PVEC_SMALL_SIZE, sizeof(SmallPvec) + PVEC_SMALL_SIZE * sizeof(void *),
+         PVEC_SMALL_SIZE);
+}
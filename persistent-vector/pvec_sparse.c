@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2014 Jean Niklas L'orange. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * This is a sparse persistent vector: A persistent array over the whole 64-bit
+ * index space, where every index is NULL until it is set. It is the vanilla
+ * trie, except that subtrees without elements are left out (they are NULL),
+ * so setting an index far away only creates the path to it, and memory is
+ * proportional to the number of elements set.
+ *
+ * The height of the trie only covers the largest index set, and grows when a
+ * larger one is set. Setting an element to NULL removes it, and the nodes left
+ * empty are removed with it, so a vector always has the same shape no matter
+ * which elements have been set and removed before.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#define SPARSE_PVEC
+#include "pvec.h"
+#include "pvec_alloc.h"
+
+// This is a trie node. It is always the branching factor size. Unused table
+// entries and subtrees without elements are NULL.
+typedef struct Node {
+  struct Node *child[PVEC_BRANCHING];
+} Node;
+
+struct _SparsePvec {
+  // The number of elements set.
+  uint64_t count;
+  // The height of the trie, represented as a shift.
+  uint32_t shift;
+  // The root of the trie. NULL if no elements are set.
+  Node *root;
+};
+
+// An empty vector. (Not necessarily the only empty vector!)
+static SparsePvec EMPTY_VECTOR = {.count = 0, .shift = 0, .root = NULL};
+
+// These are just prototypes -- no need to worry about these.
+static inline Node *node_clone(const Node *node);
+static inline SparsePvec* sparse_pvec_clone(const SparsePvec *spvec);
+
+// covers returns whether a trie with the given shift has room for index.
+static inline int covers(uint32_t shift, uint64_t index) {
+  return shift + PVEC_BITS >= 64 || (index >> (shift + PVEC_BITS)) == 0;
+}
+
+static inline int node_is_empty(const Node *node) {
+  for (uint32_t i = 0; i < PVEC_BRANCHING; i++) {
+    if (node->child[i] != NULL) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+const SparsePvec* sparse_pvec_create() {
+  return &EMPTY_VECTOR;
+}
+
+uint64_t sparse_pvec_count(const SparsePvec *spvec) {
+  return spvec->count;
+}
+
+void* sparse_pvec_nth(const SparsePvec *spvec, uint64_t index) {
+  if (!covers(spvec->shift, index)) {
+    return NULL;
+  }
+  Node *node = spvec->root;
+  for (uint32_t s = spvec->shift; s > 0 && node != NULL; s -= PVEC_BITS) {
+    node = node->child[(index >> s) & PVEC_MASK];
+  }
+  return node == NULL ? NULL : (void *) node->child[index & PVEC_MASK];
+}
+
+// remove_rec returns a copy of node without the element at index, or NULL if
+// nothing would be left in it.
+static Node *remove_rec(const Node *node, uint32_t shift, uint64_t index) {
+  uint32_t subindex = (index >> shift) & PVEC_MASK;
+  Node *copy = node_clone(node);
+  if (shift == 0) {
+    copy->child[subindex] = NULL;
+  }
+  else {
+    copy->child[subindex] = remove_rec(node->child[subindex], shift - PVEC_BITS,
+                                       index);
+  }
+  return node_is_empty(copy) ? NULL : copy;
+}
+
+static const SparsePvec* sparse_pvec_remove(const SparsePvec *spvec,
+                                            uint64_t index) {
+  if (sparse_pvec_nth(spvec, index) == NULL) {
+    return spvec;
+  }
+  if (spvec->count == 1) {
+    return sparse_pvec_create();
+  }
+  SparsePvec *clone = sparse_pvec_clone(spvec);
+  clone->count--;
+  clone->root = remove_rec(spvec->root, spvec->shift, index);
+  // Lower the height until the root has a child other than the first one.
+  while (clone->shift > 0) {
+    int only_first = 1;
+    for (uint32_t i = 1; i < PVEC_BRANCHING; i++) {
+      if (clone->root->child[i] != NULL) {
+        only_first = 0;
+      }
+    }
+    if (!only_first) {
+      break;
+    }
+    clone->root = clone->root->child[0];
+    clone->shift -= PVEC_BITS;
+  }
+  return clone;
+}
+
+const SparsePvec* sparse_pvec_update(const SparsePvec *restrict spvec,
+                                     uint64_t index, const void *restrict elt) {
+  if (elt == NULL) {
+    return sparse_pvec_remove(spvec, index);
+  }
+  SparsePvec *clone = sparse_pvec_clone(spvec);
+  if (sparse_pvec_nth(spvec, index) == NULL) {
+    clone->count++;
+  }
+  // Grow the trie until it covers index. An empty trie is just given the right
+  // height.
+  while (!covers(clone->shift, index)) {
+    if (clone->root != NULL) {
+      Node *new_root = PVEC_MALLOC(sizeof(Node));
+      new_root->child[0] = clone->root;
+      clone->root = new_root;
+    }
+    clone->shift += PVEC_BITS;
+  }
+  // Clone-or-create, as in pvec_push.
+  Node **slot = &clone->root;
+  for (uint32_t s = clone->shift; ; s -= PVEC_BITS) {
+    *slot = (*slot == NULL) ? PVEC_MALLOC(sizeof(Node)) : node_clone(*slot);
+    if (s == 0) {
+      break;
+    }
+    slot = &(*slot)->child[(index >> s) & PVEC_MASK];
+  }
+  (*slot)->child[index & PVEC_MASK] = (Node *) elt;
+  return (const SparsePvec*) clone;
+}
+
+// next_rec finds the first element at index from or later in the subtree, where
+// from is relative to the subtree. It returns 0 if there is none.
+static int next_rec(const Node *node, uint32_t shift, uint64_t from,
+                    uint64_t *index, void **elt) {
+  for (uint32_t i = (from >> shift) & PVEC_MASK; i < PVEC_BRANCHING; i++) {
+    // Only the first child we look at starts at from, the rest are searched
+    // from their start.
+    uint64_t child_from = (i == ((from >> shift) & PVEC_MASK))
+      ? from & (((uint64_t) 1 << shift) - 1) : 0;
+    if (node->child[i] == NULL) {
+      continue;
+    }
+    if (shift == 0) {
+      *index = i;
+      *elt = node->child[i];
+      return 1;
+    }
+    if (next_rec(node->child[i], shift - PVEC_BITS, child_from, index, elt)) {
+      *index |= (uint64_t) i << shift;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int sparse_pvec_next(const SparsePvec *spvec, uint64_t *index, void **elt) {
+  if (spvec->root == NULL || !covers(spvec->shift, *index)) {
+    return 0;
+  }
+  uint64_t found;
+  if (!next_rec(spvec->root, spvec->shift, *index, &found, elt)) {
+    return 0;
+  }
+  *index = found;
+  return 1;
+}
+
+// Inline helper functions
+
+static inline Node *node_clone(const Node *node) {
+  Node *clone = PVEC_MALLOC(sizeof(Node));
+  memcpy(clone, node, sizeof(Node));
+  return clone;
+}
+
+static inline SparsePvec* sparse_pvec_clone(const SparsePvec *spvec) {
+  SparsePvec *clone = PVEC_MALLOC(sizeof(SparsePvec));
+  memcpy(clone, spvec, sizeof(SparsePvec));
+  return clone;
+}
+
+int main() {
+  const SparsePvec *p = sparse_pvec_create();
+  uint64_t indices[] = {0, 7, 1000000, (uint64_t) 1 << 32, UINT64_MAX - 1, UINT64_MAX};
+  for (uint32_t i = 0; i < 6; i++) {
+    p = sparse_pvec_update(p, indices[i], (void *) (uintptr_t) (i + 1));
+  }
+  const SparsePvec *q = sparse_pvec_update(p, (uint64_t) 1 << 32, NULL);
+  printf("p has %lu elements, q has %lu\n", sparse_pvec_count(p),
+         sparse_pvec_count(q));
+
+  // Iterating through the elements of p.
+  uint64_t index = 0;
+  void *elt;
+  while (sparse_pvec_next(p, &index, &elt)) {
+    printf("  p[%lu] = %lu\n", index, (uintptr_t) elt);
+    if (index == UINT64_MAX) {
+      break;
+    }
+    index++;
+  }
+}
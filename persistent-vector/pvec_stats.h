@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2014 Jean Niklas L'orange. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef PVEC_STATS_H
+#define PVEC_STATS_H
+
+/*
+ * Latency histograms for persistent vector operations, enabled by defining
+ * PVEC_STATS. An implementation records an operation by putting
+ * PVEC_STATS_BEGIN at the start of it, and returning through PVEC_STATS_END.
+ * Without PVEC_STATS, both do nothing.
+ *
+ * The histograms are log-linear, like HDR histograms: Every power of two is
+ * split into 2**PVEC_STATS_SUB_BITS buckets, so a recorded value is off by at
+ * most 1/2**PVEC_STATS_SUB_BITS. Every thread has its own buckets, which are
+ * merged when read, so recording never contends with other threads.
+ *
+ * This header defines the pvec_stats functions, so it should only be included
+ * by one file in a program.
+ */
+
+#ifdef PVEC_STATS
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pvec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+#ifndef PVEC_STATS_SUB_BITS
+#define PVEC_STATS_SUB_BITS 4
+#endif
+
+#define PVEC_STATS_SUB_BUCKETS (1 << PVEC_STATS_SUB_BITS)
+#define PVEC_STATS_BUCKETS ((64 - PVEC_STATS_SUB_BITS + 1) * PVEC_STATS_SUB_BUCKETS)
+
+// pvec_stats_now reads the time stamp counter where there is one, and the
+// monotonic clock in nanoseconds elsewhere.
+static inline uint64_t pvec_stats_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+typedef struct PvecStatsThread {
+  // Only the owning thread writes to the buckets, so they are updated with
+  // relaxed loads and stores instead of atomic increments.
+  _Atomic uint64_t bucket[PVEC_OP_COUNT][PVEC_STATS_BUCKETS];
+  struct PvecStatsThread *next;
+} PvecStatsThread;
+
+// Every thread which has recorded something has buckets here. They are never
+// removed, so the counts of threads that have exited are kept.
+static _Atomic(PvecStatsThread *) pvec_stats_threads = NULL;
+static _Thread_local PvecStatsThread *pvec_stats_local = NULL;
+
+// Values below 2**PVEC_STATS_SUB_BITS get a bucket each. Above that, the bucket
+// is given by the position of the highest bit, and the PVEC_STATS_SUB_BITS bits
+// below it.
+static inline uint32_t pvec_stats_bucket(uint64_t value) {
+  if (value < PVEC_STATS_SUB_BUCKETS) {
+    return (uint32_t) value;
+  }
+  uint32_t high = 63 - __builtin_clzll(value);
+  uint32_t shift = high - PVEC_STATS_SUB_BITS;
+  return ((shift + 1) << PVEC_STATS_SUB_BITS)
+    + (uint32_t) ((value >> shift) & (PVEC_STATS_SUB_BUCKETS - 1));
+}
+
+// pvec_stats_bucket_value returns the highest value in the given bucket.
+static inline uint64_t pvec_stats_bucket_value(uint32_t bucket) {
+  if (bucket < PVEC_STATS_SUB_BUCKETS) {
+    return bucket;
+  }
+  uint32_t shift = (bucket >> PVEC_STATS_SUB_BITS) - 1;
+  uint64_t sub = bucket & (PVEC_STATS_SUB_BUCKETS - 1);
+  return ((PVEC_STATS_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+static void pvec_stats_record(PvecOp op, uint64_t start) {
+  uint64_t elapsed = pvec_stats_now() - start;
+  PvecStatsThread *local = pvec_stats_local;
+  if (local == NULL) {
+    local = calloc(1, sizeof(PvecStatsThread));
+    local->next = atomic_load(&pvec_stats_threads);
+    while (!atomic_compare_exchange_weak(&pvec_stats_threads, &local->next, local)) {
+    }
+    pvec_stats_local = local;
+  }
+  _Atomic uint64_t *b = &local->bucket[op][pvec_stats_bucket(elapsed)];
+  atomic_store_explicit(b, atomic_load_explicit(b, memory_order_relaxed) + 1,
+                        memory_order_relaxed);
+}
+
+void pvec_stats(PvecOp op, PvecStats *stats) {
+  uint64_t merged[PVEC_STATS_BUCKETS] = {0};
+  memset(stats, 0, sizeof(PvecStats));
+  for (PvecStatsThread *t = atomic_load(&pvec_stats_threads); t != NULL; t = t->next) {
+    for (uint32_t i = 0; i < PVEC_STATS_BUCKETS; i++) {
+      uint64_t n = atomic_load_explicit(&t->bucket[op][i], memory_order_relaxed);
+      merged[i] += n;
+      stats->count += n;
+    }
+  }
+  if (stats->count == 0) {
+    return;
+  }
+  // The percentiles are the first buckets where the running count passes them.
+  uint64_t p50 = (stats->count * 500 + 999) / 1000;
+  uint64_t p99 = (stats->count * 990 + 999) / 1000;
+  uint64_t p999 = (stats->count * 999 + 999) / 1000;
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < PVEC_STATS_BUCKETS; i++) {
+    if (merged[i] == 0) {
+      continue;
+    }
+    uint64_t value = pvec_stats_bucket_value(i);
+    if (seen == 0) {
+      stats->min = value;
+    }
+    uint64_t before = seen;
+    seen += merged[i];
+    if (before < p50 && seen >= p50) {
+      stats->p50 = value;
+    }
+    if (before < p99 && seen >= p99) {
+      stats->p99 = value;
+    }
+    if (before < p999 && seen >= p999) {
+      stats->p999 = value;
+    }
+    stats->max = value;
+  }
+}
+
+void pvec_stats_reset(void) {
+  for (PvecStatsThread *t = atomic_load(&pvec_stats_threads); t != NULL; t = t->next) {
+    for (uint32_t op = 0; op < PVEC_OP_COUNT; op++) {
+      for (uint32_t i = 0; i < PVEC_STATS_BUCKETS; i++) {
+        atomic_store_explicit(&t->bucket[op][i], 0, memory_order_relaxed);
+      }
+    }
+  }
+}
+
+#define PVEC_STATS_BEGIN uint64_t pvec_stats_start = pvec_stats_now()
+#define PVEC_STATS_END(op, val) (pvec_stats_record((op), pvec_stats_start), (val))
+
+#else
+
+#define PVEC_STATS_BEGIN
+#define PVEC_STATS_END(op, val) (val)
+
+#endif
+#endif
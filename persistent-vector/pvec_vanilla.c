@@ -30,196 +30,610 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#define VANILLA_PVEC
 #include "pvec.h"
 #include "pvec_alloc.h"
+#include "pvec_stats.h"
+
+#ifdef PVEC_PARALLEL
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
+// The core operations are those of the template in pvec_generic.h, with the
+// prefix pvec and b = PVEC_BITS. This generates the node type pvec_node, the
+// head struct _Pvec, and the static helpers used below: pvec_node_create,
+// pvec_node_clone, pvec_clone, pvec_empty_vector, and the *_head functions.
+#define PVEC_TEMPLATE_IMPLEMENTATION
+#define PVEC_TEMPLATE_TYPE Pvec
+#define PVEC_TEMPLATE_PREFIX pvec
+#define PVEC_TEMPLATE_BITS PVEC_BITS
+#define PVEC_TEMPLATE_STRUCT _Pvec
+#define PVEC_TEMPLATE_STATS
+#include "pvec_generic.h"
+
+typedef pvec_node Node;
+
+// The value API. PvecVal has the same fields as the head, so converting between
+// the two is free, and no head is ever allocated.
+
+static inline Pvec head_of(PvecVal val) {
+  return (Pvec) {.size = val.size, .shift = val.shift, .root = (Node *) val.root};
+}
 
-// This is a trie node. It is always the branching factor size (unused table
-// entries will be NULL).
-typedef struct Node {
-  struct Node *child[PVEC_BRANCHING];
-} Node;
-
-struct _Pvec {
-  // The size of the vector.
-  uint32_t size;
-  // The height of the vector, represented as a shift.
-  uint32_t shift;
-  // The root of the vector.
-  Node* root;
-};
+static inline PvecVal val_of(const Pvec *head) {
+  return (PvecVal) {.size = head->size, .shift = head->shift,
+                    .root = head->root};
+}
+
+PvecVal pvec_val(const Pvec *pvec) {
+  return val_of(pvec);
+}
+
+const Pvec* pvec_from_val(PvecVal val) {
+  Pvec head = head_of(val);
+  return pvec_clone(&head);
+}
+
+PvecVal pvec_val_create(void) {
+  return val_of(&pvec_empty_vector);
+}
+
+void* pvec_val_nth(PvecVal val, uint32_t index) {
+  Pvec head = head_of(val);
+  return pvec_nth_head(&head, index);
+}
+
+PvecVal pvec_val_update(PvecVal val, uint32_t index, const void *elt) {
+  Pvec head = head_of(val);
+  pvec_update_head(&head, index, elt);
+  return val_of(&head);
+}
 
-static Node EMPTY_NODE = {.child = {0}};
+PvecVal pvec_val_push(PvecVal val, const void *elt) {
+  Pvec head = head_of(val);
+  pvec_push_head(&head, elt);
+  return val_of(&head);
+}
 
-// An empty vector. (Not necessarily the only empty vector!)
-static Pvec EMPTY_VECTOR = {.size = 0, .shift = 0, .root = &EMPTY_NODE};
+PvecVal pvec_val_pop(PvecVal val) {
+  Pvec head = head_of(val);
+  pvec_pop_head(&head);
+  return val_of(&head);
+}
 
-// These are just prototypes -- no need to worry about these.
-static inline Node *node_create(void);
-static inline Node *node_clone(const Node* node);
-static inline Pvec* pvec_clone(const Pvec *pvec);
+PvecVal pvec_val_right_slice(PvecVal val, uint32_t new_size) {
+  Pvec head = head_of(val);
+  pvec_right_slice_head(&head, new_size);
+  return val_of(&head);
+}
 
-// pvec_create just returns the empty vector.
-const Pvec* pvec_create() {
-  return &EMPTY_VECTOR;
+// node_equals compares the first size elements in the subtrees a and b. Both
+// subtrees have the given shift.
+static int node_equals(const Node *a, const Node *b, uint32_t shift,
+                       uint32_t size) {
+  if (a == b) {
+    return 1;
+  }
+  if (shift == 0) {
+    // memcmp is vectorised by most C libraries, so we do not compare the
+    // elements one by one.
+    return memcmp(a->child, b->child, size * sizeof(Node *)) == 0;
+  }
+  uint32_t child_size = 1u << shift;
+  for (uint32_t i = 0; size > 0; i++) {
+    uint32_t n = size < child_size ? size : child_size;
+    if (!node_equals(a->child[i], b->child[i], shift - PVEC_BITS, n)) {
+      return 0;
+    }
+    size -= n;
+  }
+  return 1;
 }
 
-// pvec_count just returns the size value inside the vector head.
-uint32_t pvec_count(const Pvec *pvec) {
-  return pvec->size;
+int pvec_equals(const Pvec *a, const Pvec *b) {
+  if (a == b) {
+    return 1;
+  }
+  if (a->size != b->size) {
+    return 0;
+  }
+  if (a->shift != b->shift) {
+    // Vectors of the same size always have the same height when created by the
+    // functions above, but we do not want to depend on that.
+    for (uint32_t i = 0; i < a->size; i++) {
+      if (pvec_nth(a, i) != pvec_nth(b, i)) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+  return node_equals(a->root, b->root, a->shift, a->size);
 }
 
-void* pvec_nth(const Pvec *pvec, uint32_t index) {
+// leaf_for returns the leaf containing index.
+static Node *leaf_for(const Pvec *pvec, uint32_t index) {
   Node *node = pvec->root;
   for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
-    uint32_t subindex = (index >> s) & PVEC_MASK;
-    node = node->child[subindex];
+    node = node->child[(index >> s) & PVEC_MASK];
   }
-  // This last call is here because unsigned integers cannot be negative, thus
-  // `s >= 0` will always be true.
-  return (void *) node->child[index & PVEC_MASK];
+  return node;
 }
 
-void* pvec_peek(const Pvec *pvec) {
-  return pvec_nth(pvec, pvec_count(pvec) - 1);
+// Iterators keep the elements of the leaf they are in, and only walk the trie
+// again when they step into the next one.
+
+PvecIter pvec_iter(const Pvec *pvec, uint32_t index) {
+  return (PvecIter) {.pvec = pvec, .index = index, .leaf = NULL};
 }
 
-const Pvec* pvec_update(const Pvec *restrict pvec, uint32_t index,
-                        const void *restrict elt) {
-  Pvec *clone = pvec_clone(pvec);
-  Node *node = node_clone(pvec->root);
-  clone->root = node;
-  for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
-    uint32_t subindex = (index >> s) & PVEC_MASK;
-    node->child[subindex] = node_clone(node->child[subindex]);
-    node = node->child[subindex];
-  }
-  uint32_t subindex = index & PVEC_MASK;
-  node->child[subindex] = (Node *) elt;
-  return (const Pvec*) clone;
-}
-
-// pvec_push is equivalent to the append function described in Section 2.5, but
-// with bitwise access tricks.
-const Pvec* pvec_push(const Pvec *restrict pvec, const void *restrict elt) {
-  Pvec *clone = pvec_clone(pvec);
-  uint32_t index = pvec_count(pvec);
-  clone->size = pvec->size + 1;
-  // this is the d_full(P) check for bit vectors
-  if (pvec_count(pvec) == (PVEC_BRANCHING << pvec->shift)) {
-    Node *new_root = node_create();
-    new_root->child[0] = pvec->root;
-    clone->root = new_root;
-    clone->shift = pvec->shift + PVEC_BITS;
+int pvec_iter_next(PvecIter *iter, void **elt) {
+  if (iter->index >= iter->pvec->size) {
+    return 0;
   }
-  else {
-    clone->root = node_clone(pvec->root);
+  if (iter->leaf == NULL || (iter->index & PVEC_MASK) == 0) {
+    iter->leaf = (void *const *) leaf_for(iter->pvec, iter->index)->child;
   }
-  Node *node = clone->root;
-  for (uint32_t s = clone->shift; s > 0; s -= PVEC_BITS) {
-    uint32_t subindex = (index >> s) & PVEC_MASK;
-    if (node->child[subindex] == NULL) { // the create part of clone-or-create
-      node->child[subindex] = node_create();
-    }
-    else { // the clone part of clone-or-create
-      node->child[subindex] = node_clone(node->child[subindex]);
+  *elt = iter->leaf[iter->index & PVEC_MASK];
+  iter->index++;
+  return 1;
+}
+
+// Lazy views. A view is a chain of operations ending in a vector, where every
+// operation points at the view it is applied to.
+
+typedef enum {
+  VIEW_SOURCE,
+  VIEW_MAP,
+  VIEW_FILTER,
+  VIEW_SLICE,
+} ViewOp;
+
+struct _PvecView {
+  ViewOp op;
+  // The view this operation is applied to, NULL for VIEW_SOURCE.
+  const PvecView *parent;
+  // The number of operations in the chain, including this one.
+  uint32_t depth;
+  const Pvec *source;
+  void *(*fn)(void *elt, void *ctx);
+  int (*pred)(void *elt, void *ctx);
+  void *ctx;
+  uint32_t from, to;
+};
+
+static PvecView *view_create(const PvecView *parent, ViewOp op) {
+  PvecView *view = PVEC_MALLOC(sizeof(PvecView));
+  view->op = op;
+  view->parent = parent;
+  view->depth = parent == NULL ? 1 : parent->depth + 1;
+  return view;
+}
+
+const PvecView* pvec_view(const Pvec *pvec) {
+  PvecView *view = view_create(NULL, VIEW_SOURCE);
+  view->source = pvec;
+  return view;
+}
+
+const PvecView* pvec_view_map(const PvecView *view,
+                              void *(*fn)(void *elt, void *ctx), void *ctx) {
+  PvecView *map = view_create(view, VIEW_MAP);
+  map->fn = fn;
+  map->ctx = ctx;
+  return map;
+}
+
+const PvecView* pvec_view_filter(const PvecView *view,
+                                 int (*pred)(void *elt, void *ctx), void *ctx) {
+  PvecView *filter = view_create(view, VIEW_FILTER);
+  filter->pred = pred;
+  filter->ctx = ctx;
+  return filter;
+}
+
+const PvecView* pvec_view_take(const PvecView *view, uint32_t n) {
+  return pvec_view_slice(view, 0, n);
+}
+
+const PvecView* pvec_view_slice(const PvecView *view, uint32_t from, uint32_t to) {
+  PvecView *slice = view_create(view, VIEW_SLICE);
+  slice->from = from;
+  slice->to = to < from ? from : to;
+  return slice;
+}
+
+// A Builder creates a vector from left to right, without copying anything: The
+// nodes on the rightmost path are not shared yet, so they are filled in place.
+// level[0] is the leaf being filled, and level[i] the node above it at height i.
+typedef struct {
+  Node *level[PVEC_MAX_HEIGHT + 1];
+  uint32_t count;
+} Builder;
+
+static void builder_push(Builder *b, void *elt) {
+  uint32_t index = b->count;
+  // Whenever index crosses the boundary of a subtree, the subtree is full, and
+  // is moved into its parent. We go bottom-up, as a full node has to get its
+  // last child before it is moved.
+  uint32_t height = 0;
+  for (uint32_t s = PVEC_BITS;
+       index > 0 && (index & (((uint64_t) 1 << s) - 1)) == 0;
+       s += PVEC_BITS, height++) {
+    if (b->level[height + 1] == NULL) {
+      b->level[height + 1] = pvec_node_create();
     }
-    node = node->child[subindex];
+    b->level[height + 1]->child[((index - 1) >> s) & PVEC_MASK] = b->level[height];
+    b->level[height] = NULL;
+  }
+  if (b->level[0] == NULL) {
+    b->level[0] = pvec_node_create();
   }
-  uint32_t subindex = index & PVEC_MASK;
-  node->child[subindex] = (Node *) elt;
-  return (const Pvec*) clone;
+  b->level[0]->child[index & PVEC_MASK] = elt;
+  b->count++;
 }
 
-const Pvec* pvec_pop(const Pvec *pvec) {
-  Pvec *clone = pvec_clone(pvec);
-  uint32_t index = pvec_count(pvec) - 1;
-  clone->size = pvec_count(pvec) - 1;
-  if (pvec_count(clone) == (1 << pvec->shift) && pvec->shift > 0) {
-    clone->shift = pvec->shift - PVEC_BITS;
-    clone->root = pvec->root->child[0];
-    return clone;
+static const Pvec* builder_finish(Builder *b) {
+  if (b->count == 0) {
+    return pvec_create();
   }
-  else {
-    Node *node = node_clone(pvec->root);
-    clone->root = node;
-    for (uint32_t s = pvec->shift; s > 0; s -= PVEC_BITS) {
-      uint32_t subindex = (index >> s) & PVEC_MASK;
-      if ((index & (((2*PVEC_BITS) << s) - 1)) == 0) {
-        node->child[subindex] = NULL;
-        return clone;
+  Pvec *pvec = PVEC_MALLOC(sizeof(Pvec));
+  pvec->size = b->count;
+  pvec->shift = 0;
+  while (b->count > ((uint64_t) PVEC_BRANCHING << pvec->shift)) {
+    pvec->shift += PVEC_BITS;
+  }
+  // Attach the partially filled nodes on the rightmost path to their parents.
+  uint32_t last = b->count - 1;
+  uint32_t height = 0;
+  for (uint32_t s = PVEC_BITS; s <= pvec->shift; s += PVEC_BITS, height++) {
+    if (b->level[height] != NULL) {
+      if (b->level[height + 1] == NULL) {
+        b->level[height + 1] = pvec_node_create();
       }
-      else {
-        node->child[subindex] = node_clone(node->child[subindex]);
-        node = node->child[subindex];
+      b->level[height + 1]->child[(last >> s) & PVEC_MASK] = b->level[height];
+    }
+  }
+  pvec->root = b->level[height];
+  return pvec;
+}
+
+const Pvec* pvec_view_materialise(const PvecView *view) {
+  // Put the operations in the order they are applied.
+  const PvecView **ops = PVEC_MALLOC(view->depth * sizeof(PvecView *));
+  uint32_t depth = view->depth;
+  for (const PvecView *v = view; v != NULL; v = v->parent) {
+    ops[v->depth - 1] = v;
+  }
+  const Pvec *source = ops[0]->source;
+
+  // Slices before the first filter select positions in the source vector, so we
+  // only visit those. Maps do not move elements, so we can skip past them.
+  // Those slices are not applied again below.
+  uint32_t from = 0, to = source->size;
+  uint32_t pushed = 1;
+  for (; pushed < depth && ops[pushed]->op != VIEW_FILTER; pushed++) {
+    if (ops[pushed]->op == VIEW_SLICE) {
+      uint32_t len = to - from;
+      to = from + (ops[pushed]->to < len ? ops[pushed]->to : len);
+      from = from + (ops[pushed]->from < len ? ops[pushed]->from : len);
+    }
+  }
+
+  // The remaining slices count the elements reaching them.
+  uint32_t *seen = PVEC_MALLOC_ATOMIC(depth * sizeof(uint32_t));
+  memset(seen, 0, depth * sizeof(uint32_t));
+  Builder b;
+  memset(&b, 0, sizeof(Builder));
+  uint32_t index = from;
+  while (index < to) {
+    // Find the leaf containing index, and run all its elements through the
+    // operations.
+    const Node *leaf = source->root;
+    for (uint32_t s = source->shift; s > 0; s -= PVEC_BITS) {
+      leaf = leaf->child[(index >> s) & PVEC_MASK];
+    }
+    uint32_t end = (index | PVEC_MASK) < to - 1 ? (index | PVEC_MASK) + 1 : to;
+    for (; index < end; index++) {
+      void *elt = (void *) leaf->child[index & PVEC_MASK];
+      for (uint32_t i = 1; i < depth; i++) {
+        const PvecView *op = ops[i];
+        switch (op->op) {
+        case VIEW_MAP:
+          elt = op->fn(elt, op->ctx);
+          break;
+        case VIEW_FILTER:
+          if (!op->pred(elt, op->ctx)) {
+            goto next;
+          }
+          break;
+        case VIEW_SLICE:
+          if (i < pushed) {
+            break;
+          }
+          // Nothing after a finished slice can reach the result, so we stop.
+          if (seen[i] >= op->to) {
+            goto done;
+          }
+          if (seen[i]++ < op->from) {
+            goto next;
+          }
+          break;
+        case VIEW_SOURCE:
+          break;
+        }
       }
+      builder_push(&b, elt);
+    next:;
     }
-    node->child[index & PVEC_MASK] = NULL;
-    return clone;
-  }
-}
-
-// Performing a right slice on a persistent vector. Implemented in Scala (with
-// displays), but not in Clojure.
-const Pvec* pvec_right_slice(const Pvec *pvec, uint32_t new_size){
-  Pvec *clone = pvec_clone(pvec);
-  uint32_t index = new_size;
-  clone->size = new_size;
-
-  // We have to cut the tree until the height is minimal
-  while (pvec_count(clone) <= (1 << clone->shift) && clone->shift > 0) {
-    clone->shift = clone->shift - PVEC_BITS;
-    clone->root = clone->root->child[0];
-  }
-
-  // The tree being fully dense is a special case, and is short-circuited
-  if (pvec_count(clone) == (PVEC_BRANCHING << clone->shift)) {
-    return clone;
-  }
-  
-  // Notice that this part is almost exactly the same as the `else` part within
-  // the pvec_pop function. The only difference is the memset functions to
-  // ensure that all elements right of the trie to walk is nilled through
-  // the memset function.
-  Node *node = node_clone(clone->root);
-  clone->root = node;
-  for (uint32_t s = clone->shift; s > 0; s -= PVEC_BITS) {
-    uint32_t subindex = (index >> s) & PVEC_MASK;
-    if ((index & (((2*PVEC_BITS) << s) - 1)) == 0) {
-      memset(&node->child[subindex], 0,
-             (PVEC_BRANCHING - subindex) * sizeof(Node *));
-      return clone;
+  }
+ done:
+  return builder_finish(&b);
+}
+
+#ifdef PVEC_PARALLEL
+
+// PVEC_PARALLEL_MIN is the smallest vector built or filtered with more than one
+// thread. Below it, starting threads costs more than it saves.
+#ifndef PVEC_PARALLEL_MIN
+#define PVEC_PARALLEL_MIN (1 << 16)
+#endif
+
+// run_parallel calls worker(arg) on the calling thread and up to threads - 1
+// other threads, and waits for all of them. The workers split the work between
+// themselves. If threads could not be started, the ones we have do all of it.
+static void run_parallel(void *(*worker)(void *), void *arg, uint32_t threads) {
+  pthread_t *workers = NULL;
+  if (threads > 1) {
+    workers = malloc((threads - 1) * sizeof(pthread_t));
+  }
+  uint32_t started = 0;
+  while (workers != NULL && started < threads - 1 &&
+         pthread_create(&workers[started], NULL, worker, arg) == 0) {
+    started++;
+  }
+  worker(arg);
+  for (uint32_t i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  free(workers);
+}
+
+// build_dense returns a subtree with the given shift, containing the n elements
+// in elts. If elts is NULL, the leaves are left empty, to be filled in later.
+static Node *build_dense(void *const *elts, uint64_t n, uint32_t shift) {
+  Node *node = pvec_node_create();
+  if (shift == 0) {
+    if (elts != NULL) {
+      memcpy(node->child, elts, n * sizeof(void *));
     }
-    else {
-      node->child[subindex] = node_clone(node->child[subindex]);
-      memset(&node->child[subindex + 1], 0,
-             (PVEC_BRANCHING - (subindex - 1)) * sizeof(Node *));
-      node = node->child[subindex];
+    return node;
+  }
+  uint64_t child_size = (uint64_t) PVEC_BRANCHING << (shift - PVEC_BITS);
+  for (uint32_t i = 0; n > 0; i++) {
+    uint64_t k = n < child_size ? n : child_size;
+    node->child[i] = build_dense(elts, k, shift - PVEC_BITS);
+    if (elts != NULL) {
+      elts += k;
     }
+    n -= k;
   }
-  uint32_t subindex = index & PVEC_MASK;
-  memset(&node->child[subindex + 1], 0,
-         (PVEC_BRANCHING - (subindex - 1)) * sizeof(Node *));
-  return clone;
+  return node;
 }
 
-// Inline helper functions
+// build_top returns a subtree with the given shift, where the m subtrees in
+// subtrees (with shift task_shift) are the lowest nodes.
+static Node *build_top(Node **subtrees, uint64_t m, uint32_t shift,
+                       uint32_t task_shift) {
+  if (shift == task_shift) {
+    return subtrees[0];
+  }
+  Node *node = pvec_node_create();
+  uint64_t per_child = (uint64_t) 1 << (shift - PVEC_BITS - task_shift);
+  for (uint32_t i = 0; m > 0; i++) {
+    uint64_t k = m < per_child ? m : per_child;
+    node->child[i] = build_top(subtrees, k, shift - PVEC_BITS, task_shift);
+    subtrees += k;
+    m -= k;
+  }
+  return node;
+}
 
-static inline Node *node_create(void) {
-  Node *new = PVEC_MALLOC(sizeof(Node));
-  return new;
+typedef struct {
+  void *const *elts;
+  uint32_t n;
+  uint32_t task_shift;
+  // The subtrees built, and the index of the next subtree to build.
+  Node **subtrees;
+  uint64_t task_count;
+  _Atomic uint64_t next;
+} BuildTasks;
+
+static void *build_worker(void *arg) {
+  BuildTasks *tasks = arg;
+  uint64_t task_size = (uint64_t) PVEC_BRANCHING << tasks->task_shift;
+  for (;;) {
+    uint64_t i = atomic_fetch_add(&tasks->next, 1);
+    if (i >= tasks->task_count) {
+      return NULL;
+    }
+    uint64_t from = i * task_size;
+    uint64_t k = tasks->n - from < task_size ? tasks->n - from : task_size;
+    void *const *elts = tasks->elts == NULL ? NULL : tasks->elts + from;
+    tasks->subtrees[i] = build_dense(elts, k, tasks->task_shift);
+  }
 }
 
-static inline Node *node_clone(const Node* node) {
-  Node *clone = PVEC_MALLOC(sizeof(Node));
-  memcpy(clone, node, sizeof(Node));
-  return clone;
+// build_parallel returns a vector with the n elements in elts, or with n empty
+// slots if elts is NULL.
+static Pvec *build_parallel(void *const *elts, uint32_t n, uint32_t threads) {
+  Pvec *pvec = PVEC_MALLOC(sizeof(Pvec));
+  pvec->size = n;
+  pvec->shift = 0;
+  while (n > ((uint64_t) PVEC_BRANCHING << pvec->shift)) {
+    pvec->shift += PVEC_BITS;
+  }
+  if (threads <= 1 || n < PVEC_PARALLEL_MIN) {
+    pvec->root = build_dense(elts, n, pvec->shift);
+    return pvec;
+  }
+
+  // We split the vector into subtrees of the same height, small enough that
+  // there are a couple of subtrees per thread to even out the load. The
+  // threads take subtrees until there are none left, and the levels above the
+  // subtrees are built afterwards.
+  BuildTasks tasks = {.elts = elts, .n = n, .task_shift = pvec->shift};
+  uint64_t task_size = (uint64_t) PVEC_BRANCHING << tasks.task_shift;
+  while (tasks.task_shift > 0 &&
+         (n + task_size - 1) / task_size < 4 * (uint64_t) threads) {
+    tasks.task_shift -= PVEC_BITS;
+    task_size >>= PVEC_BITS;
+  }
+  tasks.task_count = (n + task_size - 1) / task_size;
+  tasks.subtrees = PVEC_MALLOC(tasks.task_count * sizeof(Node *));
+  atomic_init(&tasks.next, 0);
+  run_parallel(build_worker, &tasks, threads);
+
+  pvec->root = build_top(tasks.subtrees, tasks.task_count, pvec->shift,
+                         tasks.task_shift);
+  return pvec;
+}
+
+const Pvec* pvec_from_array_parallel(void *const *elts, uint32_t n,
+                                     uint32_t threads) {
+  if (n == 0) {
+    return pvec_create();
+  }
+  return build_parallel(elts, n, threads);
+}
+
+typedef struct {
+  const Pvec *pvec;
+  int (*pred)(void *elt, void *ctx);
+  void *ctx;
+  // The input is split into tasks of task_size elements, a multiple of the leaf
+  // size.
+  uint32_t task_size;
+  uint32_t task_count;
+  _Atomic uint32_t next;
+  // keep[i] is 1 if element i is kept. survivors[t] is the number of elements
+  // task t keeps, and afterwards where the first of them goes in the result.
+  uint8_t *keep;
+  uint32_t *survivors;
+  Pvec *result;
+} FilterTasks;
+
+static void *filter_count_worker(void *arg) {
+  FilterTasks *tasks = arg;
+  for (;;) {
+    uint32_t t = atomic_fetch_add(&tasks->next, 1);
+    if (t >= tasks->task_count) {
+      return NULL;
+    }
+    uint32_t index = t * tasks->task_size;
+    uint32_t end = tasks->pvec->size - index < tasks->task_size
+      ? tasks->pvec->size : index + tasks->task_size;
+    uint32_t count = 0;
+    while (index < end) {
+      Node *leaf = leaf_for(tasks->pvec, index);
+      uint32_t leaf_end = end - index < PVEC_BRANCHING ? end : index + PVEC_BRANCHING;
+      for (; index < leaf_end; index++) {
+        void *elt = (void *) leaf->child[index & PVEC_MASK];
+        tasks->keep[index] = tasks->pred(elt, tasks->ctx) != 0;
+        count += tasks->keep[index];
+      }
+    }
+    tasks->survivors[t] = count;
+  }
+}
+
+// The result leaves are all allocated up front, so the tasks write directly into
+// them. Two tasks may write into the same leaf, but never into the same slot.
+static void *filter_write_worker(void *arg) {
+  FilterTasks *tasks = arg;
+  for (;;) {
+    uint32_t t = atomic_fetch_add(&tasks->next, 1);
+    if (t >= tasks->task_count) {
+      return NULL;
+    }
+    uint32_t index = t * tasks->task_size;
+    uint32_t end = tasks->pvec->size - index < tasks->task_size
+      ? tasks->pvec->size : index + tasks->task_size;
+    uint32_t out = tasks->survivors[t];
+    Node *out_leaf = NULL;
+    while (index < end) {
+      Node *leaf = leaf_for(tasks->pvec, index);
+      uint32_t leaf_end = end - index < PVEC_BRANCHING ? end : index + PVEC_BRANCHING;
+      for (; index < leaf_end; index++) {
+        if (!tasks->keep[index]) {
+          continue;
+        }
+        if (out_leaf == NULL || (out & PVEC_MASK) == 0) {
+          out_leaf = leaf_for(tasks->result, out);
+        }
+        out_leaf->child[out & PVEC_MASK] = leaf->child[index & PVEC_MASK];
+        out++;
+      }
+    }
+  }
 }
 
-static inline Pvec* pvec_clone(const Pvec *pvec) {
-  Pvec *clone = PVEC_MALLOC(sizeof(Pvec));
-  memcpy(clone, pvec, sizeof(Pvec));
-  return clone;
+const Pvec* pvec_filter_parallel(const Pvec *pvec,
+                                 int (*pred)(void *elt, void *ctx), void *ctx,
+                                 uint32_t threads) {
+  if (pvec->size == 0) {
+    return pvec;
+  }
+  if (threads == 0 || pvec->size < PVEC_PARALLEL_MIN) {
+    threads = 1;
+  }
+  FilterTasks tasks = {.pvec = pvec, .pred = pred, .ctx = ctx};
+  // With a couple of tasks per thread, a thread getting slow tasks (an
+  // expensive predicate, or many survivors) does not hold the others back.
+  uint32_t per_task = pvec->size / (4 * (uint64_t) threads) + 1;
+  tasks.task_size = (per_task + PVEC_MASK) & ~PVEC_MASK;
+  tasks.task_count = (pvec->size - 1) / tasks.task_size + 1;
+  tasks.keep = malloc(pvec->size);
+  tasks.survivors = malloc(tasks.task_count * sizeof(uint32_t));
+  if (tasks.keep == NULL || tasks.survivors == NULL) {
+    // Without room for the keep flags, filter sequentially through a view,
+    // which needs no memory besides the result.
+    free(tasks.keep);
+    free(tasks.survivors);
+    return pvec_view_materialise(pvec_view_filter(pvec_view(pvec), pred, ctx));
+  }
+
+  // First, we find the elements to keep, and how many each task keeps. Then,
+  // the prefix sum of those counts tells each task where its first survivor
+  // goes.
+  atomic_init(&tasks.next, 0);
+  run_parallel(filter_count_worker, &tasks, threads);
+  uint32_t total = 0;
+  for (uint32_t t = 0; t < tasks.task_count; t++) {
+    uint32_t count = tasks.survivors[t];
+    tasks.survivors[t] = total;
+    total += count;
+  }
+
+  const Pvec *result;
+  if (total == pvec->size) {
+    result = pvec;
+  }
+  else if (total == 0) {
+    result = pvec_create();
+  }
+  else {
+    tasks.result = build_parallel(NULL, total, threads);
+    atomic_store(&tasks.next, 0);
+    run_parallel(filter_write_worker, &tasks, threads);
+    result = tasks.result;
+  }
+  free(tasks.keep);
+  free(tasks.survivors);
+  return result;
 }
+#endif
 
 // Persistent vector dot printing functions. Some are internal, others are
 // external. See pvec.h for those who are external.
@@ -256,7 +670,7 @@ static void pvec_to_dot_rec(FILE *out, Node *root, uint32_t shift, uint32_t size
     fprintf(out,
             "  </tr>\n"
             "</table>>];\n");
-    uint32_t child_size = (1 << shift);
+    uint32_t child_size = (1u << shift);
     uint32_t i = 0;
     while (size > child_size) {
       size -= child_size;
@@ -362,7 +776,7 @@ static void node_to_dot_rec(FILE* out, char *colour, Node *root, uint32_t shift,
     fprintf(out,
             "  </tr>\n"
             "</table>>];\n");
-    uint32_t child_size = (1 << shift);
+    uint32_t child_size = (1u << shift);
     uint32_t i = 0;
     while (size > child_size) {
       size -= child_size;
@@ -411,6 +825,91 @@ void pvecs_to_dot(Pvec **vec, int n, char *loch) {
   fclose(out);
 }
 
+#ifdef PVEC_BENCH
+
+// Compiling with -DPVEC_BENCH replaces the example below with a small benchmark
+// of lookups and updates in a large vector. Compare builds with different
+// PVEC_BITS and PVEC_CACHE_LINE settings to see the effect of the node layout.
+int main() {
+  const uint32_t size = 1 << 22;
+  const uint32_t ops = 1 << 24;
+  void **elts = malloc(size * sizeof(void *));
+  for (uintptr_t i = 0; i < size; i++) {
+    elts[i] = (void *) i;
+  }
+  const Pvec *p = pvec_push_many(pvec_create(), elts, size);
+  free(elts);
+
+  // xorshift, to avoid measuring rand()
+  uint32_t x = 2463534242;
+  uintptr_t sum = 0;
+  clock_t start = clock();
+  for (uint32_t i = 0; i < ops; i++) {
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    sum += (uintptr_t) pvec_nth(p, x & (size - 1));
+  }
+  double nth_ns = 1e9 * (clock() - start) / CLOCKS_PER_SEC / ops;
+
+  // Reading every element in order, compared with one pvec_nth per element.
+  start = clock();
+  for (uint32_t i = 0; i < size; i++) {
+    sum += (uintptr_t) pvec_nth(p, i);
+  }
+  double seq_nth_ns = 1e9 * (clock() - start) / CLOCKS_PER_SEC / size;
+  start = clock();
+  PvecIter it = pvec_iter(p, 0);
+  void *elt;
+  while (pvec_iter_next(&it, &elt)) {
+    sum += (uintptr_t) elt;
+  }
+  double iter_ns = 1e9 * (clock() - start) / CLOCKS_PER_SEC / size;
+
+  start = clock();
+  for (uint32_t i = 0; i < ops / 16; i++) {
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    p = pvec_update(p, x & (size - 1), (void *) (uintptr_t) i);
+  }
+  double update_ns = 1e9 * (clock() - start) / CLOCKS_PER_SEC / (ops / 16);
+
+  // The same updates through the value API, which does not allocate heads.
+  PvecVal v = pvec_val(p);
+  start = clock();
+  for (uint32_t i = 0; i < ops / 16; i++) {
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    v = pvec_val_update(v, x & (size - 1), (void *) (uintptr_t) i);
+  }
+  double val_update_ns = 1e9 * (clock() - start) / CLOCKS_PER_SEC / (ops / 16);
+
+  printf("b = %d, node size = %zu bytes, height = %u\n", PVEC_BITS,
+         sizeof(Node), p->shift / PVEC_BITS + 1);
+  printf("pvec_nth:    %6.1f ns/op (checksum %lx)\n", nth_ns, sum);
+  printf("in order, pvec_nth: %6.1f ns/elt, pvec_iter_next: %6.1f ns/elt\n",
+         seq_nth_ns, iter_ns);
+  printf("pvec_update: %6.1f ns/op\n", update_ns);
+  printf("pvec_val_update: %6.1f ns/op\n", val_update_ns);
+
+#ifdef PVEC_STATS
+  // With PVEC_STATS, the latency distributions are printed as well.
+  const char *names[PVEC_OP_COUNT] = {"nth", "push", "update", "pop",
+                                      "right_slice"};
+  for (int op = 0; op < PVEC_OP_COUNT; op++) {
+    PvecStats stats;
+    pvec_stats(op, &stats);
+    if (stats.count > 0) {
+      printf("%-12s n=%-9lu p50=%-6lu p99=%-6lu p999=%-6lu max=%lu\n", names[op],
+             stats.count, stats.p50, stats.p99, stats.p999, stats.max);
+    }
+  }
+#endif
+}
+
+#else
+
+static int example_odd(void *elt, void *ctx) {
+  (void) ctx;
+  return ((uintptr_t) elt) & 1;
+}
+
 int main() {
   const Pvec *p = pvec_create();
   for (uintptr_t i = 0; i < 100; i++) {
@@ -434,4 +933,18 @@ int main() {
   }
   Pvec *multi[2] = {pvec_right_slice(p, 4), pvec_right_slice(p, 16)};
   pvecs_to_dot(&multi, 2, "vanilla-multi.dot");
+
+  // The first 10 odd elements from the 50th and on. Elements after the tenth
+  // odd one are never visited.
+  const PvecView *view = pvec_view_take(pvec_view_filter(pvec_view_slice(
+      pvec_view(p), 50, 100), example_odd, NULL), 10);
+  const Pvec *odds = pvec_view_materialise(view);
+  PvecIter it = pvec_iter(odds, 0);
+  void *elt;
+  while (pvec_iter_next(&it, &elt)) {
+    printf("%lu ", (uintptr_t) elt);
+  }
+  printf("\n");
 }
+
+#endif